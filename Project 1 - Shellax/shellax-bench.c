@@ -0,0 +1,992 @@
+/*
+	Benchmarks for shellax, built on the shell itself:
+
+		gcc -O2 -o shellax-bench shellax-bench.c
+		./shellax-bench spawn [-n launches] [-m heap_mb]
+		./shellax-bench chat [-u users] [-r rate] [-d seconds] [-t transport]
+		./shellax-bench parse [-n lines]
+		./shellax-bench pipeline [-m input_mb] [-h heap_mb]
+		./shellax-bench history [-n entries]
+		./shellax-bench suite [-q] [-o results.json]
+
+	The suite runs the launch, pipeline, parse, history and builtin measurements
+	with fixed parameters and writes them as one JSON document, so runs of
+	different releases can be compared by name.
+*/
+#define SHELLAX_NO_MAIN
+#include "shellax-skeleton.c"
+#include <time.h>
+#include <sys/utsname.h>
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/**
+ * Parse a command line the same way prompt() does
+ * @param  line command line, the parser copies it into its arena
+ * @return      the command, release with free_command()
+ */
+static struct command_t *bench_parse(const char *line)
+{
+	struct command_t *command=malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	parse_command((char *)line, command);
+	return command;
+}
+
+/**
+ * Launch a command repeatedly through process_command()
+ * @return launches per second
+ */
+static double bench_launch(const char *line, int count)
+{
+	struct command_t *command=bench_parse(line);
+	double start=now_sec();
+	for (int i=0;i<count;++i)
+		process_command(command);
+	double elapsed=now_sec()-start;
+	free_command(command);
+	return count/elapsed;
+}
+
+/**
+ * Compare the launch modes with a shell heap of heap_mb megabytes
+ * The zygote is started first, the way main() does with SHELLAX_LAUNCH=zygote.
+ */
+static int bench_spawn(int argc, char **argv)
+{
+	int count=2000, heap_mb=256;
+	for (int i=0;i<argc;++i)
+	{
+		if (strcmp(argv[i], "-n")==0 && i+1<argc)
+			count=atoi(argv[++i]);
+		else if (strcmp(argv[i], "-m")==0 && i+1<argc)
+			heap_mb=atoi(argv[++i]);
+	}
+	if (zygote_start()==-1)
+		return 1;
+
+	//touch the heap, so fork has page tables to copy
+	char *heap=malloc((size_t)heap_mb<<20);
+	memset(heap, 1, (size_t)heap_mb<<20);
+
+	printf("%d launches of /bin/true with a %d MB heap\n", count, heap_mb);
+	printf("%-8s %14s %14s\n", "mode", "launches/s", "usec/launch");
+	for (int i=0;launch_mode_names[i];++i)
+	{
+		set_launch_mode(launch_mode_names[i]);
+		double rate=bench_launch("true", count);
+		printf("%-8s %14.0f %14.1f\n", launch_mode_names[i], rate, 1e6/rate);
+	}
+	free(heap);
+	return 0;
+}
+
+/*
+	The chat benchmark forks one chatroom_func() per synthetic user with
+	its stdin and stdout on pipes to the benchmark. Every message carries
+	the sequence number of its sender and the time it was written to the
+	sender's stdin, so each line a user prints gives one end-to-end
+	latency. Within a transport the messages of one sender reach a receiver
+	in order, so a sequence number at or below the last one seen from that
+	sender is a duplicate and a jump over some is a loss.
+*/
+struct bench_user {
+	int in; // stdin of the user, the benchmark writes messages here
+	int out; // stdout of the user
+	pid_t pid;
+	char buf[1<<16];
+	size_t have;
+	bool joined;
+	long sent;
+};
+
+struct bench_chat {
+	struct bench_user *users;
+	int count;
+	long *last; // last sequence number receiver r saw from sender s, [r*count+s]
+	long delivered, duplicated, lost;
+	uint32_t *latency; // microseconds of every delivery
+	size_t latency_count, latency_capacity;
+};
+
+static int64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/**
+ * Account for one line printed by user r
+ */
+static void bench_chat_line(struct bench_chat *chat, int r, const char *line, int64_t now)
+{
+	struct bench_user *user=&chat->users[r];
+	if (strstr(line, "Welcome to ")==line)
+	{
+		user->joined=true;
+		return;
+	}
+	int s;
+	long seq;
+	long long sent_at;
+	//"[room] u<sender>: <seq> <time>", the user's own lines are echoes
+	const char *text=strchr(line, ']');
+	if (text==NULL || sscanf(text, "] u%d: %ld %lld", &s, &seq, &sent_at)!=3
+		|| s<0 || s>=chat->count || s==r)
+		return;
+
+	long *last=&chat->last[(size_t)r*chat->count+s];
+	if (seq<=*last)
+	{
+		chat->duplicated++;
+		return;
+	}
+	chat->lost+=seq-*last-1;
+	*last=seq;
+	chat->delivered++;
+	if (chat->latency_count==chat->latency_capacity)
+	{
+		chat->latency_capacity=chat->latency_capacity?chat->latency_capacity*2:1<<16;
+		chat->latency=realloc(chat->latency, chat->latency_capacity*sizeof(uint32_t));
+	}
+	int64_t usec=(now-sent_at)/1000;
+	chat->latency[chat->latency_count++]=usec<0?0:usec>UINT32_MAX?UINT32_MAX:usec;
+}
+
+/**
+ * Read what the users printed, waiting at most timeout_ms
+ * @return number of users with output
+ */
+static int bench_chat_collect(struct bench_chat *chat, struct pollfd *pfd, int timeout_ms)
+{
+	int ready=poll(pfd, chat->count, timeout_ms);
+	if (ready<=0)
+		return 0;
+	int64_t now=bench_now_ns();
+	for (int r=0;r<chat->count;++r)
+	{
+		if (!(pfd[r].revents&(POLLIN|POLLHUP)))
+			continue;
+		struct bench_user *user=&chat->users[r];
+		ssize_t n=read(user->out, user->buf+user->have, sizeof(user->buf)-1-user->have);
+		if (n<=0)
+		{
+			pfd[r].fd=-1; // the user is gone
+			continue;
+		}
+		user->have+=n;
+		user->buf[user->have]=0;
+		char *start=user->buf, *nl;
+		while ((nl=strchr(start, '\n'))!=NULL)
+		{
+			*nl=0;
+			bench_chat_line(chat, r, start, now);
+			start=nl+1;
+		}
+		user->have-=start-user->buf;
+		memmove(user->buf, start, user->have);
+		if (user->have==sizeof(user->buf)-1) // a line longer than the buffer
+			user->have=0;
+	}
+	return ready;
+}
+
+static int bench_compare_u32(const void *a, const void *b)
+{
+	uint32_t x=*(const uint32_t *)a, y=*(const uint32_t *)b;
+	return x<y?-1:x>y;
+}
+
+/**
+ * Remove the room directory of a finished run
+ */
+static void bench_remove_room(const char *room)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/tmp/chatroom-%s/.history", room);
+	DIR *dir=opendir(path);
+	struct dirent *ent;
+	while (dir && (ent=readdir(dir))!=NULL)
+		if (ent->d_name[0]!='.')
+			unlinkat(dirfd(dir), ent->d_name, 0);
+	if (dir)
+		closedir(dir);
+	rmdir(path);
+	snprintf(path, sizeof(path), "/tmp/chatroom-%s/.broker.lock", room);
+	unlink(path);
+	snprintf(path, sizeof(path), "/tmp/chatroom-%s", room);
+	rmdir(path);
+}
+
+/**
+ * Drive a room with synthetic users and report throughput and latency
+ */
+static int bench_chat(int argc, char **argv)
+{
+	int count=8, seconds=5;
+	double rate=100; // messages per second of every user
+	struct chat_options options={ .transport=CHAT_FIFO, .replay_count=0, .replay_since=-1 };
+	for (int i=0;i<argc;++i)
+	{
+		if (strcmp(argv[i], "-u")==0 && i+1<argc)
+			count=atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r")==0 && i+1<argc)
+			rate=atof(argv[++i]);
+		else if (strcmp(argv[i], "-d")==0 && i+1<argc)
+			seconds=atoi(argv[++i]);
+		else if (strcmp(argv[i], "-t")==0 && i+1<argc)
+		{
+			i++;
+			options.transport=strcmp(argv[i], "broker")==0?CHAT_BROKER
+				:strcmp(argv[i], "shm")==0?CHAT_SHM:CHAT_FIFO;
+		}
+	}
+	if (count<2 || rate<=0 || seconds<=0)
+	{
+		fprintf(stderr, "chat: need at least 2 users, a rate and a duration\n");
+		return 1;
+	}
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl)==0)
+	{
+		rl.rlim_cur=rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	char room[64];
+	snprintf(room, sizeof(room), "bench-%d", getpid());
+	struct bench_chat chat={ .count=count };
+	chat.users=calloc(count, sizeof(struct bench_user));
+	chat.last=calloc((size_t)count*count, sizeof(long));
+	for (size_t i=0;i<(size_t)count*count;++i)
+		chat.last[i]=-1;
+	struct pollfd *pfd=calloc(count, sizeof(struct pollfd));
+
+	fflush(stdout);
+	for (int u=0;u<count;++u)
+	{
+		int in[2], out[2];
+		if (pipe2(in, O_CLOEXEC)==-1 || pipe2(out, O_CLOEXEC)==-1)
+		{
+			fprintf(stderr, "chat: pipe: %s\n", strerror(errno));
+			return 1;
+		}
+		pid_t pid=fork();
+		if (pid==0)
+		{
+			dup2(in[0], STDIN_FILENO);
+			dup2(out[1], STDOUT_FILENO);
+			close(in[0]);
+			close(in[1]); // the user has to see the end of its input
+			close(out[0]);
+			close(out[1]);
+			for (int v=0;v<u;++v)
+			{
+				close(chat.users[v].in);
+				close(chat.users[v].out);
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "u%d", u);
+			chatroom_func(room, name, &options);
+			fflush(stdout);
+			_exit(0);
+		}
+		close(in[0]);
+		close(out[1]);
+		chat.users[u]=(struct bench_user){ .in=in[1], .out=out[0], .pid=pid };
+		pfd[u]=(struct pollfd){ .fd=out[0], .events=POLLIN };
+	}
+
+	//wait until everyone is in the room, then give the receivers a moment
+	int joined=0;
+	double deadline=now_sec()+10;
+	while (joined<count && now_sec()<deadline)
+	{
+		bench_chat_collect(&chat, pfd, 100);
+		joined=0;
+		for (int u=0;u<count;++u)
+			joined+=chat.users[u].joined;
+	}
+	if (joined<count)
+		fprintf(stderr, "chat: only %d of %d users joined\n", joined, count);
+	bench_chat_collect(&chat, pfd, 300);
+
+	//each user sends rate messages a second, spread over the run
+	double start=now_sec(), end=start+seconds;
+	long total_sent=0;
+	while (now_sec()<end)
+	{
+		double elapsed=now_sec()-start;
+		long due=(long)(elapsed*rate)+1;
+		for (int u=0;u<count;++u)
+			while (chat.users[u].sent<due)
+			{
+				char line[64];
+				int len=snprintf(line, sizeof(line), "%ld %lld\n", chat.users[u].sent,
+					(long long)bench_now_ns());
+				if (write(chat.users[u].in, line, len)!=len)
+					break;
+				chat.users[u].sent++;
+				total_sent++;
+			}
+		bench_chat_collect(&chat, pfd, 1);
+	}
+	double sent_end=now_sec();
+	//drain until nothing arrives for half a second
+	while (bench_chat_collect(&chat, pfd, 500)>0)
+		;
+	double elapsed=sent_end-start;
+
+	//messages that never arrived at the end of a stream are lost too
+	for (int r=0;r<count;++r)
+		for (int s=0;s<count;++s)
+			if (r!=s)
+				chat.lost+=chat.users[s].sent-1-chat.last[(size_t)r*count+s];
+
+	for (int u=0;u<count;++u)
+		close(chat.users[u].in);
+	while (bench_chat_collect(&chat, pfd, 200)>0)
+		;
+	for (int u=0;u<count;++u)
+	{
+		close(chat.users[u].out);
+		waitpid(chat.users[u].pid, NULL, 0);
+	}
+	bench_remove_room(room);
+
+	static const char *transports[]={ "fifo", "broker", "shm" };
+	qsort(chat.latency, chat.latency_count, sizeof(uint32_t), bench_compare_u32);
+	printf("%d users, %s, %.0f msgs/s each for %d s\n", count, transports[options.transport], rate, seconds);
+	printf("%-12s %12ld\n", "sent", total_sent);
+	printf("%-12s %12ld\n", "delivered", chat.delivered);
+	printf("%-12s %12.0f\n", "delivered/s", chat.delivered/elapsed);
+	printf("%-12s %12ld\n", "lost", chat.lost);
+	printf("%-12s %12ld\n", "duplicated", chat.duplicated);
+	if (chat.latency_count>0)
+	{
+		static const struct { const char *name; double q; } q[]={
+			{ "p50 usec", 0.5 }, { "p99 usec", 0.99 }, { "p999 usec", 0.999 } };
+		for (int i=0;i<3;++i)
+			printf("%-12s %12u\n", q[i].name, chat.latency[(size_t)(q[i].q*(chat.latency_count-1))]);
+	}
+	free(chat.latency);
+	free(chat.last);
+	free(chat.users);
+	free(pfd);
+	return 0;
+}
+
+/**
+ * Parse and free a line repeatedly
+ * @return lines per second
+ */
+static double bench_parse_line(const char *line, int count)
+{
+	double start=now_sec();
+	for (int i=0;i<count;++i)
+		free_command(bench_parse(line));
+	return count/(now_sec()-start);
+}
+
+/**
+ * Write a parsed command back as a line: the argv of each stage, then its
+ * redirections, stages joined by " | " and " &" for a background line
+ */
+static void bench_parse_render(struct command_t *command, char *out, size_t size)
+{
+	static const char *redirects[3]={ " <", " >", " >>" };
+	size_t len=0;
+	out[0]=0;
+	for (struct command_t *c=command;c && len<size;c=c->next)
+	{
+		for (int i=0;c->argv[i] && len<size;++i)
+			len+=snprintf(out+len, size-len, "%s%s", i?" ":"", c->argv[i]);
+		for (int i=0;i<3 && len<size;++i)
+			if (c->redirects[i])
+				len+=snprintf(out+len, size-len, "%s%s", redirects[i], c->redirects[i]);
+		if (c->next && len<size)
+			len+=snprintf(out+len, size-len, " | ");
+	}
+	if (command->background && len<size)
+		snprintf(out+len, size-len, " &");
+}
+
+/**
+ * Check that lines parse into the expected stages, words with quotes and
+ * escapes included, before timing the parser
+ * @return number of lines that parsed wrong
+ */
+static int bench_parse_check(void)
+{
+	static const char *cases[][2]={
+		{ "ls -la /tmp", "ls -la /tmp" },
+		{ "echo hi|cat -A", "echo hi | cat -A" },
+		{ "echo \"hi\"|cat -A", "echo hi | cat -A" },
+		{ "echo 'a b'|cat", "echo a b | cat" },
+		{ "echo a\\ b|tr a X", "echo a b | tr a X" },
+		{ "echo 'a b'>out", "echo a b >out" },
+		{ "echo \"a\">>out", "echo a >>out" },
+		{ "echo a\\ b>>out", "echo a b >>out" },
+		{ "cat<'in file'|wc", "cat <in file | wc" },
+		{ "cat \"in\"<in", "cat in <in" },
+		{ "cat x\\y<in", "cat xy <in" },
+		{ "sleep \"1\"&", "sleep 1 &" },
+		{ "sleep '1'&", "sleep 1 &" },
+		{ "sleep 1\\ &", "sleep 1  &" },
+		{ "echo \"a|b\" 'c>d' e\\&f", "echo a|b c>d e&f" },
+		{ "a|b|c > out < in", "a | b | c <in >out" },
+	};
+	int failed=0;
+	char rendered[256];
+	for (size_t i=0;i<sizeof(cases)/sizeof(cases[0]);++i)
+	{
+		struct command_t *command=bench_parse(cases[i][0]);
+		bench_parse_render(command, rendered, sizeof(rendered));
+		free_command(command);
+		if (strcmp(rendered, cases[i][1])!=0)
+		{
+			fprintf(stderr, "parse: %s: got \"%s\", expected \"%s\"\n", cases[i][0], rendered, cases[i][1]);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+/**
+ * Lines parsed per second, from a short command to generated lines of
+ * several kilobytes with hundreds of quoted and escaped arguments
+ */
+static int bench_parse_lines(int argc, char **argv)
+{
+	int count=200000;
+	for (int i=0;i<argc;++i)
+		if (strcmp(argv[i], "-n")==0 && i+1<argc)
+			count=atoi(argv[++i]);
+	if (bench_parse_check())
+		return 1;
+
+	//a generated line: 400 arguments, some of them quoted or escaped
+	size_t size=64*1024, len=0;
+	char *generated=malloc(size);
+	len+=snprintf(generated+len, size-len, "printf '%%s\\n'");
+	for (int i=0;i<400;++i)
+		len+=snprintf(generated+len, size-len, i%3==0?" \"arg %d\"":i%3==1?" 'x y%d'":" a\\ b%d", i);
+	len+=snprintf(generated+len, size-len, " | sort | uniq -c > out.txt");
+
+	struct { const char *name; const char *line; } lines[]={
+		{ "short", "ls -la /tmp" },
+		{ "pipeline", "cat data.txt | grep -v '#' | sort -k2 | uniq -c > counts.txt &" },
+		{ "generated", generated },
+	};
+	printf("%-10s %8s %14s %10s\n", "line", "bytes", "lines/s", "MB/s");
+	for (size_t i=0;i<sizeof(lines)/sizeof(lines[0]);++i)
+	{
+		size_t bytes=strlen(lines[i].line);
+		int n=bytes>1024?count/20:count;
+		double rate=bench_parse_line(lines[i].line, n);
+		printf("%-10s %8zu %14.0f %10.1f\n", lines[i].name, bytes, rate, rate*bytes/1e6);
+	}
+	free(generated);
+	return 0;
+}
+
+/**
+ * Run a pipeline over a file through process_command() and time it
+ * @return megabytes of input per second
+ */
+static double bench_pipeline_run(const char *line, size_t bytes, int rounds)
+{
+	struct command_t *command=bench_parse(line);
+	double start=now_sec();
+	for (int i=0;i<rounds;++i)
+		process_command(command);
+	double elapsed=now_sec()-start;
+	free_command(command);
+	return rounds*bytes/1e6/elapsed;
+}
+
+/**
+ * Write a log like input: 60 byte lines, with repeats
+ * @param  path   template for mkstemp, replaced by the name
+ * @return        bytes written, 0 on error
+ */
+static size_t bench_pipeline_input(char *path, size_t size)
+{
+	int fd=mkstemp(path);
+	if (fd==-1)
+	{
+		fprintf(stderr, "-%s: mkstemp: %s\n", sysname, strerror(errno));
+		return 0;
+	}
+	FILE *file=fdopen(fd, "w");
+	size_t bytes=0;
+	for (long i=0;bytes<size;++i)
+		bytes+=fprintf(file, "%08ld GET /static/asset/%06ld.css HTTP/1.1 200 OK\n", i%4096, (i*7919)%(1<<20)/16);
+	fclose(file);
+	return bytes;
+}
+
+/**
+ * Throughput of builtin stages, forked and on threads of the shell, for a
+ * small input where starting the stages dominates and for a large one
+ */
+static int bench_pipeline(int argc, char **argv)
+{
+	int mb=64, heap_mb=256;
+	for (int i=0;i<argc;++i)
+	{
+		if (strcmp(argv[i], "-m")==0 && i+1<argc)
+			mb=atoi(argv[++i]);
+		else if (strcmp(argv[i], "-h")==0 && i+1<argc)
+			heap_mb=atoi(argv[++i]);
+	}
+
+	//touch the heap, so fork has page tables to copy
+	char *heap=malloc((size_t)heap_mb<<20);
+	memset(heap, 1, (size_t)heap_mb<<20);
+
+	struct { char path[32]; size_t bytes; int rounds; } inputs[]={
+		{ "/tmp/shellax-bench-XXXXXX", 64<<10, 200 },
+		{ "/tmp/shellax-bench-XXXXXX", (size_t)mb<<20, 3 },
+	};
+	for (int i=0;i<2;++i)
+		if ((inputs[i].bytes=bench_pipeline_input(inputs[i].path, inputs[i].bytes))==0)
+			return 1;
+
+	const char *lines[]={
+		"cat %s | myuniq -c > /dev/null",
+		"cat %s | vigenere enc lemon > /dev/null",
+		"cat %s | vigenere enc lemon | vigenere dec lemon | myuniq > /dev/null",
+	};
+	printf("shell heap of %d MB\n", heap_mb);
+	printf("%-72s %8s %10s %12s\n", "pipeline", "input", "fork MB/s", "thread MB/s");
+	for (int in=0;in<2;++in)
+		for (size_t i=0;i<sizeof(lines)/sizeof(lines[0]);++i)
+		{
+			char line[256];
+			snprintf(line, sizeof(line), lines[i], inputs[in].path);
+			set_builtin_threads("off");
+			bench_pipeline_run(line, inputs[in].bytes, 1); // page cache and heap warm up
+			double forked=bench_pipeline_run(line, inputs[in].bytes, inputs[in].rounds);
+			set_builtin_threads("on");
+			double threaded=bench_pipeline_run(line, inputs[in].bytes, inputs[in].rounds);
+			snprintf(line, sizeof(line), lines[i], "FILE");
+			printf("%-72s %6zuKB %10.1f %12.1f\n", line, inputs[in].bytes>>10, forked, threaded);
+		}
+	for (int i=0;i<2;++i)
+		unlink(inputs[i].path);
+	free(heap);
+	return 0;
+}
+
+/*
+	The history benchmark writes a history of synthetic command lines,
+	points SHELLAX_HISTORY at it and times history_search() the way Ctrl-R
+	calls it, from the newest entry back. The first entry holds a marker
+	no other entry has, so finding it and the misses cross the whole
+	history. Every query is first checked against a plain scan of the
+	entries.
+*/
+#define BENCH_HISTORY_MARKER "echo history-bench-first"
+
+static const char *bench_history_queries[]={
+	BENCH_HISTORY_MARKER, // the oldest entry
+	"git status", // recent
+	"cd ~/src/parser.c", // a miss made of triples that are all in the history
+	"kubectl apply -f", // misses with a triple or pair the history does not have
+	"zq",
+};
+
+/**
+ * Write entries synthetic command lines to a new file
+ * @param  path template for mkstemp, replaced by the name
+ * @return      0, -1 after printing the problem
+ */
+static int bench_history_file(char *path, long entries)
+{
+	//every format takes a word and then a number, or a prefix of them
+	static const char *commands[]={
+		"git status", "git commit -m \"fix %s %ld\"", "git checkout -b %s-%ld",
+		"cd ~/src/%s", "ls -la /var/log/%s", "make %s -j%ld", "vim src/%s.c",
+		"grep -rn \"%s\" src/ include/", "ssh %s%ld.lab.example.org",
+		"python3 tools/%s.py --size %ld", "tail -f /var/log/%s.log",
+		"./shellax-bench %s -n %ld", "cat %s.txt | sort | uniq -c > out",
+	};
+	static const char *words[]={
+		"parser", "jobs", "zygote", "chatroom", "history", "pipeline", "build",
+		"kernel", "network", "cache", "server", "client", "config", "release",
+	};
+	int fd=mkstemp(path);
+	if (fd==-1)
+	{
+		fprintf(stderr, "-%s: mkstemp: %s\n", sysname, strerror(errno));
+		return -1;
+	}
+	FILE *file=fdopen(fd, "w");
+	fprintf(file, BENCH_HISTORY_MARKER "\n");
+	uint32_t seed=1;
+	for (long i=1;i<entries;++i)
+	{
+		seed=seed*1103515245+12345;
+		const char *format=commands[(seed>>16)%(sizeof(commands)/sizeof(commands[0]))];
+		const char *word=words[(seed>>8)%(sizeof(words)/sizeof(words[0]))];
+		fprintf(file, format, word, (long)(seed>>4)%1000);
+		putc('\n', file);
+	}
+	fclose(file);
+	return 0;
+}
+
+/**
+ * The newest entry before `before` that contains query, by reading every entry
+ */
+static long bench_history_scan(const char *query, long before)
+{
+	size_t len=strlen(query), entry_len;
+	for (long i=before-1;i>=0;--i)
+	{
+		const char *entry=history_get(i, &entry_len);
+		if (memmem(entry, entry_len, query, len))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Time a search over the whole history
+ * @return searches per second
+ */
+static double bench_history_search(const char *query, int count)
+{
+	size_t len=strlen(query);
+	long entries=history_count();
+	double start=now_sec();
+	for (int i=0;i<count;++i)
+		history_search(query, len, entries);
+	return count/(now_sec()-start);
+}
+
+/**
+ * Open a history of entries lines and check every query against a scan
+ * @param  path  template for mkstemp, the caller unlinks it and its .idx
+ * @param  open  set to the seconds it took to map the history and build its filters
+ * @return       0, -1 on error or a wrong answer
+ */
+static int bench_history_open(char *path, long entries, double *open)
+{
+	if (bench_history_file(path, entries)==-1)
+		return -1;
+	setenv("SHELLAX_HISTORY", path, 1);
+	double start=now_sec();
+	if (history_count()!=entries)
+	{
+		fprintf(stderr, "history: %ld entries indexed, expected %ld\n", history_count(), entries);
+		return -1;
+	}
+	history_search("x", 1, entries); // the first search builds the filters
+	*open=now_sec()-start;
+	for (size_t i=0;i<sizeof(bench_history_queries)/sizeof(bench_history_queries[0]);++i)
+	{
+		const char *query=bench_history_queries[i];
+		long found=history_search(query, strlen(query), entries);
+		long expected=bench_history_scan(query, entries);
+		if (found!=expected)
+		{
+			fprintf(stderr, "history: %s: found entry %ld, expected %ld\n", query, found, expected);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Slowest keystroke of typing query into Ctrl-R, the way prompt_search()
+ * narrows it: from the last match on, and not at all once a prefix failed
+ * @return seconds
+ */
+static double bench_history_keystroke(const char *query)
+{
+	long entries=history_count(), match=-1;
+	double slowest=0;
+	for (size_t len=1;len<=strlen(query);++len)
+	{
+		if (match==-1 && len>1)
+			break;
+		double start=now_sec();
+		match=history_search(query, len, match>=0?match+1:entries);
+		double elapsed=now_sec()-start;
+		if (elapsed>slowest)
+			slowest=elapsed;
+	}
+	return slowest;
+}
+
+/**
+ * Reverse search over a large history, the answer to each keystroke of Ctrl-R
+ */
+static int bench_history(int argc, char **argv)
+{
+	long entries=1000000;
+	for (int i=0;i<argc;++i)
+		if (strcmp(argv[i], "-n")==0 && i+1<argc)
+			entries=atol(argv[++i]);
+
+	char path[]="/tmp/shellax-history-XXXXXX", idx_path[sizeof(path)+4];
+	double open;
+	int code=bench_history_open(path, entries, &open);
+	snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+	if (code==0)
+	{
+		size_t len;
+		history_get(entries-1, &len);
+		printf("%ld entries, %.1f MB, indexed and filtered in %.1f ms\n", entries,
+			(history.offsets[entries-1]+len+1)/1e6, open*1e3);
+		printf("%-26s %10s %12s\n", "query", "entry", "usec/search");
+		for (size_t i=0;i<sizeof(bench_history_queries)/sizeof(bench_history_queries[0]);++i)
+		{
+			const char *query=bench_history_queries[i];
+			printf("%-26s %10ld %12.1f\n", query, history_search(query, strlen(query), entries),
+				1e6/bench_history_search(query, 200));
+		}
+		for (size_t i=0;i<3;++i)
+			printf("slowest keystroke typing \"%s\": %.1f usec\n", bench_history_queries[i],
+				bench_history_keystroke(bench_history_queries[i])*1e6);
+	}
+	unlink(path);
+	unlink(idx_path);
+	return code==0?0:1;
+}
+
+/*
+	The suite writes one JSON object: the machine it ran on and a flat
+	"results" array. Every result has a name that stays the same between
+	releases, the unit of its value, and the number of iterations behind
+	it; higher is better for every unit. -q runs a tenth of the
+	iterations on smaller inputs, for a quick check.
+*/
+struct bench_json {
+	FILE *out;
+	int results;
+};
+
+/**
+ * Append one result to the "results" array
+ * @param name       stable name of the measurement, like "pipeline/4-stage/16MB"
+ * @param unit       unit of value
+ * @param iterations how many runs were timed
+ */
+static void bench_json_result(struct bench_json *json, const char *name,
+	const char *unit, double value, long iterations)
+{
+	fprintf(json->out, "%s\n\t\t{ \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f, \"iterations\": %ld }",
+		json->results++?",":"", name, unit, value, iterations);
+	fflush(json->out);
+	fprintf(stderr, "%-40s %14.1f %s\n", name, value, unit);
+}
+
+/**
+ * Time a stream builtin over a file, the way a pipeline stage calls it,
+ * with its output going to /dev/null
+ * @param  line   the builtin's command line, without redirections
+ * @return        megabytes of input per second
+ */
+static double bench_builtin_run(const char *line, const char *path, size_t bytes, int rounds)
+{
+	struct command_t *command=bench_parse(line);
+	FILE *out=fopen("/dev/null", "w");
+	double start=now_sec();
+	for (int i=0;i<rounds;++i)
+	{
+		int in=open(path, O_RDONLY|O_CLOEXEC);
+		if (strcmp(command->name, "myuniq")==0)
+			myuniq_func(command, in, out);
+		else
+			vigenere_stream_func(command->args[0], command->args[1], in, fileno(out));
+		close(in);
+	}
+	fflush(out);
+	double elapsed=now_sec()-start;
+	fclose(out);
+	free_command(command);
+	return rounds*bytes/1e6/elapsed;
+}
+
+/**
+ * Run every measurement with fixed parameters and write the results as JSON
+ */
+static int bench_suite(int argc, char **argv)
+{
+	int scale=1;
+	const char *path=NULL;
+	for (int i=0;i<argc;++i)
+	{
+		if (strcmp(argv[i], "-q")==0)
+			scale=10;
+		else if (strcmp(argv[i], "-o")==0 && i+1<argc)
+			path=argv[++i];
+	}
+	if (bench_parse_check())
+		return 1;
+	struct bench_json json={ stdout, 0 };
+	if (path && (json.out=fopen(path, "w"))==NULL)
+	{
+		fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
+	if (zygote_start()==-1)
+		return 1;
+
+	struct utsname host;
+	uname(&host);
+	fprintf(json.out, "{\n\t\"benchmark\": \"shellax\",\n\t\"time\": %ld,\n\t\"quick\": %s,\n",
+		(long)time(NULL), scale>1?"true":"false");
+	fprintf(json.out, "\t\"host\": { \"system\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld },\n",
+		host.sysname, host.release, host.machine, sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(json.out, "\t\"results\": [");
+
+	char name[128];
+	//launches of /bin/true through process_command(), in every launch mode
+	for (int i=0;launch_mode_names[i];++i)
+	{
+		int count=2000/scale;
+		set_launch_mode(launch_mode_names[i]);
+		bench_launch("/bin/true", count/10); // warm up the zygote and the page cache
+		snprintf(name, sizeof(name), "spawn/%s", launch_mode_names[i]);
+		bench_json_result(&json, name, "launches/s", bench_launch("/bin/true", count), count);
+	}
+	set_launch_mode("fork");
+
+	//inputs for the pipelines and the builtins
+	struct { char path[32]; size_t bytes; const char *label; } inputs[]={
+		{ "/tmp/shellax-bench-XXXXXX", 64<<10, "64KB" },
+		{ "/tmp/shellax-bench-XXXXXX", 1<<20, "1MB" },
+		{ "/tmp/shellax-bench-XXXXXX", (size_t)16<<20, "16MB" },
+	};
+	int input_count=scale>1?2:3;
+	for (int i=0;i<input_count;++i)
+		if ((inputs[i].bytes=bench_pipeline_input(inputs[i].path, inputs[i].bytes))==0)
+			return 1;
+
+	//bytes through pipelines of cat built by pipe_execute()
+	const int stages[]={ 2, 4, 8 };
+	for (size_t s=0;s<sizeof(stages)/sizeof(stages[0]);++s)
+	{
+		int in=input_count-1, rounds=10/(scale>1?2:1);
+		char line[256];
+		size_t len=snprintf(line, sizeof(line), "cat %s", inputs[in].path);
+		for (int i=1;i<stages[s];++i)
+			len+=snprintf(line+len, sizeof(line)-len, " | cat");
+		snprintf(line+len, sizeof(line)-len, " > /dev/null");
+		bench_pipeline_run(line, inputs[in].bytes, 1);
+		snprintf(name, sizeof(name), "pipeline/%d-stage/%s", stages[s], inputs[in].label);
+		bench_json_result(&json, name, "MB/s", bench_pipeline_run(line, inputs[in].bytes, rounds), rounds);
+	}
+
+	//Ctrl-R over a history of a million entries
+	char history_path[]="/tmp/shellax-history-XXXXXX", history_idx[sizeof(history_path)+4];
+	double history_open;
+	long history_entries=1000000/scale;
+	int code=bench_history_open(history_path, history_entries, &history_open);
+	if (code==0)
+	{
+		int count=2000/scale;
+		bench_json_result(&json, "history/open", "opens/s", 1/history_open, 1);
+		bench_json_result(&json, "history/oldest-entry", "searches/s",
+			bench_history_search(BENCH_HISTORY_MARKER, count), count);
+		bench_json_result(&json, "history/miss", "searches/s",
+			bench_history_search("kubectl apply -f", count), count);
+		bench_json_result(&json, "history/miss-common-grams", "searches/s",
+			bench_history_search("cd ~/src/parser.c", count/20+1), count/20+1);
+		bench_json_result(&json, "history/slowest-keystroke", "keystrokes/s",
+			1/bench_history_keystroke(BENCH_HISTORY_MARKER), strlen(BENCH_HISTORY_MARKER));
+		bench_json_result(&json, "history/slowest-keystroke-common-grams", "keystrokes/s",
+			1/bench_history_keystroke("cd ~/src/parser.c"), strlen("cd ~/src/parser.c"));
+	}
+	snprintf(history_idx, sizeof(history_idx), "%s.idx", history_path);
+	unlink(history_path);
+	unlink(history_idx);
+
+	//lines parsed by parse_command()
+	size_t size=64*1024, len=0;
+	char *generated=malloc(size);
+	len+=snprintf(generated+len, size-len, "printf '%%s\\n'");
+	for (int i=0;i<400;++i)
+		len+=snprintf(generated+len, size-len, i%3==0?" \"arg %d\"":i%3==1?" 'x y%d'":" a\\ b%d", i);
+	snprintf(generated+len, size-len, " | sort | uniq -c > out.txt");
+	struct { const char *name; const char *line; int count; } lines[]={
+		{ "parse/short", "ls -la /tmp", 200000 },
+		{ "parse/pipeline", "cat data.txt | grep -v '#' | sort -k2 | uniq -c > counts.txt &", 200000 },
+		{ "parse/generated", generated, 10000 },
+	};
+	for (size_t i=0;i<sizeof(lines)/sizeof(lines[0]);++i)
+	{
+		int count=lines[i].count/scale;
+		bench_json_result(&json, lines[i].name, "lines/s", bench_parse_line(lines[i].line, count), count);
+	}
+	free(generated);
+
+	//the stream builtins at every input size, and myuniq over mmap
+	const char *builtins[][2]={
+		{ "myuniq", "myuniq" },
+		{ "myuniq-c", "myuniq -c" },
+		{ "vigenere-enc", "vigenere enc lemon" },
+		{ "vigenere-dec", "vigenere dec lemon" },
+	};
+	for (size_t b=0;b<sizeof(builtins)/sizeof(builtins[0]);++b)
+		for (int in=0;in<input_count;++in)
+		{
+			//about 64MB of input per measurement
+			int rounds=(int)((64<<20)/scale/inputs[in].bytes)+1;
+			bench_builtin_run(builtins[b][1], inputs[in].path, inputs[in].bytes, 1);
+			snprintf(name, sizeof(name), "%s/%s", builtins[b][0], inputs[in].label);
+			bench_json_result(&json, name, "MB/s",
+				bench_builtin_run(builtins[b][1], inputs[in].path, inputs[in].bytes, rounds), rounds);
+		}
+	for (int in=0;in<input_count;++in)
+	{
+		char line[256];
+		int rounds=(int)((64<<20)/scale/inputs[in].bytes)+1;
+		snprintf(line, sizeof(line), "myuniq %s", inputs[in].path);
+		bench_builtin_run(line, inputs[in].path, inputs[in].bytes, 1);
+		snprintf(name, sizeof(name), "myuniq-file/%s", inputs[in].label);
+		bench_json_result(&json, name, "MB/s",
+			bench_builtin_run(line, inputs[in].path, inputs[in].bytes, rounds), rounds);
+	}
+
+	fprintf(json.out, "\n\t]\n}\n");
+	if (json.out!=stdout)
+		fclose(json.out);
+	for (int i=0;i<input_count;++i)
+		unlink(inputs[i].path);
+	return code==0?0:1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc>1 && strcmp(argv[1], "spawn")==0)
+		return bench_spawn(argc-2, argv+2);
+	if (argc>1 && strcmp(argv[1], "chat")==0)
+		return bench_chat(argc-2, argv+2);
+	if (argc>1 && strcmp(argv[1], "parse")==0)
+		return bench_parse_lines(argc-2, argv+2);
+	if (argc>1 && strcmp(argv[1], "pipeline")==0)
+		return bench_pipeline(argc-2, argv+2);
+	if (argc>1 && strcmp(argv[1], "history")==0)
+		return bench_history(argc-2, argv+2);
+	if (argc>1 && strcmp(argv[1], "suite")==0)
+		return bench_suite(argc-2, argv+2);
+	fprintf(stderr, "usage: %s spawn [-n launches] [-m heap_mb]\n", argv[0]);
+	fprintf(stderr, "       %s chat [-u users] [-r rate] [-d seconds] [-t fifo|broker|shm]\n", argv[0]);
+	fprintf(stderr, "       %s parse [-n lines]\n", argv[0]);
+	fprintf(stderr, "       %s pipeline [-m input_mb] [-h heap_mb]\n", argv[0]);
+	fprintf(stderr, "       %s history [-n entries]\n", argv[0]);
+	fprintf(stderr, "       %s suite [-q] [-o results.json]\n", argv[0]);
+	return 1;
+}
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE // pipe2, strtok_r and the Linux specific calls
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
@@ -8,13 +14,30 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h> 
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/time.h> // timeradd
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h> // TIOCGWINSZ
+#include <sys/timerfd.h>
 
 #define MAX_BUF 4096
 
 const char * sysname = "shellax";
+bool interactive = true; // false while running a script or -c
 
 enum return_codes {
 	SUCCESS = 0,
@@ -22,19 +45,240 @@ enum return_codes {
 	UNKNOWN = 2,
 };
 
+///Arena allocator
+/*
+	Bump allocator over a list of blocks. Allocations are never freed one by
+	one and never move, the whole arena is released at once. The parser
+	sizes the blocks of its per-line arena after the line, so a line costs
+	one malloc.
+*/
+#define ARENA_BLOCK_SIZE (1<<20)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arena_block *head;
+	size_t block_size; // of new blocks, ARENA_BLOCK_SIZE when 0
+};
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size=(size+7)&~(size_t)7; // keep everything 8 byte aligned
+	struct arena_block *block=arena->head;
+	if (block==NULL || block->used+size>block->size)
+	{
+		size_t block_size=arena->block_size?arena->block_size:ARENA_BLOCK_SIZE;
+		if (size>block_size)
+			block_size=size;
+		block=malloc(sizeof(struct arena_block)+block_size);
+		block->next=arena->head;
+		block->used=0;
+		block->size=block_size;
+		arena->head=block;
+	}
+	void *p=block->data+block->used;
+	block->used+=size;
+	return p;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+	size_t len=strlen(s)+1;
+	return memcpy(arena_alloc(arena, len), s, len);
+}
+
+void arena_free(struct arena *arena)
+{
+	while (arena->head)
+	{
+		struct arena_block *next=arena->head->next;
+		free(arena->head);
+		arena->head=next;
+	}
+}
+
+///Tracing
+/*
+	SHELLAX_TRACE=file.json records where the time of a command line goes,
+	as Chrome trace events that Perfetto and chrome://tracing open: the
+	parse, every command, the pipes, each fork or spawn, the redirections
+	and exec of a child, the wait, and each stage from its start until it
+	is reaped. Events carry the pid they belong to, so every process gets
+	a track of its own, named after its command. Each event is one
+	write() to a file opened with O_APPEND, so the shell and its children
+	can add events at the same time without mixing them up, and a trace
+	cut short by a crash only lacks its closing ] which the viewers
+	accept. To time exec in fork mode the parent waits for each external
+	child to exec before it forks the next stage.
+*/
+static int trace_fd=-1;
+static pid_t trace_owner; // only the shell closes the trace, not its forks
+
+bool tracing(void)
+{
+	return trace_fd!=-1;
+}
+
+/**
+ * Microseconds on CLOCK_MONOTONIC, the clock of every event
+ */
+double trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+/**
+ * Copy a string into JSON, escaped and cut to fit
+ */
+static size_t trace_escape(char *out, size_t size, const char *s)
+{
+	size_t n=0;
+	for (;*s && n+7<size;++s)
+	{
+		unsigned char c=*s;
+		if (c=='"' || c=='\\')
+		{
+			out[n++]='\\';
+			out[n++]=c;
+		}
+		else if (c<0x20)
+			n+=sprintf(out+n, "\\u%04x", c);
+		else
+			out[n++]=c;
+	}
+	out[n]=0;
+	return n;
+}
+
+/**
+ * Append one event
+ * @param name   shown on the slice
+ * @param ph     X for a complete event, B and E for a begin and an end,
+ *               i for an instant and M for the name of a track
+ * @param ts     start, from trace_now()
+ * @param dur    microseconds, for X
+ * @param pid    track of the event, 0 for the calling process
+ * @param tid    thread within the track, 0 for the main one
+ * @param detail shown under args, NULL for none
+ */
+void trace_event(const char *name, char ph, double ts, double dur, pid_t pid, pid_t tid,
+	const char *detail)
+{
+	if (trace_fd==-1)
+		return;
+	char event[1024], escaped[256], args[512], dur_field[48]="";
+	if (pid==0)
+		pid=getpid();
+	trace_escape(escaped, sizeof(escaped), name);
+	args[0]=0;
+	if (ph=='M')
+		snprintf(args, sizeof(args), ",\"args\":{\"name\":\"%s\"}", escaped);
+	else if (detail)
+	{
+		char value[400];
+		trace_escape(value, sizeof(value), detail);
+		snprintf(args, sizeof(args), ",\"args\":{\"detail\":\"%s\"}", value);
+	}
+	if (ph=='X')
+		snprintf(dur_field, sizeof(dur_field), ",\"dur\":%.3f", dur);
+	int len=snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f%s,\"pid\":%d,\"tid\":%d%s},\n",
+		ph=='M'?"process_name":escaped, ph, ts, dur_field, pid, tid?tid:pid, args);
+	if (len>0 && len<(int)sizeof(event))
+		write(trace_fd, event, len);
+}
+
+/**
+ * Write the last event and the closing bracket
+ */
+void trace_close(void)
+{
+	if (trace_fd==-1 || getpid()!=trace_owner)
+		return;
+	char end[256];
+	int len=snprintf(end, sizeof(end), "{\"name\":\"exit\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}\n]\n",
+		trace_now(), trace_owner, trace_owner);
+	write(trace_fd, end, len);
+	close(trace_fd);
+	trace_fd=-1;
+}
+
+/**
+ * Start a trace, called by main for SHELLAX_TRACE
+ * @return 0, -1 if the file can not be created
+ */
+int trace_open(const char *path)
+{
+	trace_fd=open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if (trace_fd==-1)
+		return -1;
+	trace_owner=getpid();
+	write(trace_fd, "[\n", 2);
+	trace_event(sysname, 'M', 0, 0, 0, 0, NULL);
+	atexit(trace_close);
+	return 0;
+}
+
 struct command_t {
 	char *name;
 	bool background;
 	bool auto_complete;
 	int arg_count;
-	char **args;
+	char **args; // argv+1
+	char **argv; // name, the arguments and NULL, ready for exec
 	char *redirects[3]; // in/out redirection
 	struct command_t *next; // for piping
+	struct arena arena; // of the first stage, holds every stage and string of the line
+};
+
+enum chat_transports {
+	CHAT_FIFO = 0,
+	CHAT_BROKER = 1,
+	CHAT_SHM = 2,
+};
+
+struct chat_options {
+	int transport;
+	long replay_count; // messages of the history shown on joining
+	long replay_since; // or every message since this epoch second, when >=0
 };
 
-void chatroom_func(char *room_name, char *user_name);
-int uniq_func(int flag);
+void chatroom_func(char *room_name, char *user_name, struct chat_options *options);
+int chat_parse_options(struct command_t *command, struct chat_options *options,
+	char **room_name, char **user_name);
+size_t chat_frame(char *frame, const char *user, const char *text);
+void chat_receive_frames(int fd, const char *room_name);
+int uniq_func(int flag, int in_fd, FILE *out);
 void vigenere_func(char *mode, char *plaintext, char *key);
+int vigenere_stream_func(char *mode, char *key, int in_fd, int out_fd);
+int vigenere_crack_func(char *text, int in_fd, FILE *out);
+int shell_poll(int fd, int timeout);
+void history_add(const char *line);
+long history_count(void);
+const char *history_get(long i, size_t *len);
+long history_search(const char *query, size_t len, long before);
+
+struct completion {
+	struct arena arena; // holds the names
+	char **names; // sorted, at most COMPLETION_LIST of the matches
+	int count;
+	int capacity;
+	long total; // matches, listed or not
+	size_t common; // length of the prefix they all share
+	size_t shown; // names are listed from here, past the directory part
+};
+
+void completion_start(void);
+void completion_rescan(void);
+void completion_find(const char *word, bool command_word, struct completion *result);
+void completion_print(struct completion *result);
+int complete_func(struct command_t *command);
 
 /**
  * Prints a command struct
@@ -67,21 +311,7 @@ void print_command(struct command_t * command)
  */
 int free_command(struct command_t *command)
 {
-	if (command->arg_count)
-	{
-		for (int i=0; i<command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
-	for (int i=0;i<3;++i)
-		if (command->redirects[i])
-			free(command->redirects[i]);
-	if (command->next)
-	{
-		free_command(command->next);
-		command->next=NULL;
-	}
-	free(command->name);
+	arena_free(&command->arena); // the stages and their strings live there
 	free(command);
 	return 0;
 }
@@ -97,121 +327,426 @@ int show_prompt()
 	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
 	return 0;
 }
+/*
+	The line is copied once into an arena owned by the first stage, and
+	every string of the command is a slice of that copy: the lexer removes
+	quotes and escapes in place and ends each word with a NUL, so no word is
+	copied again. The stages and their argv arrays come from the same
+	arena and free_command() releases the whole line at once.
+
+	Words are split at blanks and at the operators | & < > >>, which do not
+	need blanks around them. '...' is literal, "..." honours \" \\ \$ and
+	\`, and outside quotes a backslash escapes any character.
+*/
+enum token_types {
+	TOKEN_END,
+	TOKEN_WORD,
+	TOKEN_PIPE,
+	TOKEN_AMP,
+	TOKEN_IN,
+	TOKEN_OUT,
+	TOKEN_APPEND,
+	TOKEN_ERROR,
+};
+
+struct lexer {
+	char *p;
+	char held; // operator overwritten by the NUL ending the previous word
+};
+
+static bool is_operator(char c)
+{
+	return c=='|' || c=='&' || c=='<' || c=='>';
+}
+
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Read the next token
+ * @param  word set to the word for TOKEN_WORD
+ * @return      one of token_types
  */
-int parse_command(char *buf, struct command_t *command)
+static int next_token(struct lexer *lex, char **word)
 {
-	const char *splitters=" \t"; // split at whitespace
-	int index, len;
-	len=strlen(buf);
-	while (len>0 && strchr(splitters, buf[0])!=NULL) // trim left whitespace
+	char *p=lex->p;
+	char c=lex->held?lex->held:*p;
+	if (lex->held==0)
 	{
-		buf++;
-		len--;
+		while (*p==' ' || *p=='\t')
+			p++;
+		c=*p;
+	}
+	if (c==0)
+		return TOKEN_END;
+	if (is_operator(c))
+	{
+		int type=c=='|'?TOKEN_PIPE:c=='&'?TOKEN_AMP:c=='<'?TOKEN_IN:TOKEN_OUT;
+		p++;
+		lex->held=0;
+		if (type==TOKEN_OUT && *p=='>')
+		{
+			type=TOKEN_APPEND;
+			p++;
+		}
+		lex->p=p;
+		return type;
+	}
+
+	char *out=p;
+	*word=p;
+	while (*p && *p!=' ' && *p!='\t' && !is_operator(*p))
+	{
+		if (*p=='\'')
+		{
+			for (p++;*p && *p!='\'';)
+				*out++=*p++;
+			if (*p++==0)
+				return TOKEN_ERROR;
+		}
+		else if (*p=='"')
+		{
+			for (p++;*p && *p!='"';)
+			{
+				if (*p=='\\' && (p[1]=='"' || p[1]=='\\' || p[1]=='$' || p[1]=='`'))
+					p++;
+				*out++=*p++;
+			}
+			if (*p++==0)
+				return TOKEN_ERROR;
+		}
+		else if (*p=='\\' && p[1])
+		{
+			p++;
+			*out++=*p++;
+		}
+		else
+			*out++=*p++;
+	}
+	if (is_operator(*p))
+	{
+		//the word ends right before an operator, the NUL overwrites it
+		//unless quotes or escapes shortened the word
+		if (out==p)
+			lex->held=*p;
+	}
+	else if (*p)
+		p++; // a blank, swallowed by the NUL
+	*out=0;
+	lex->p=p;
+	return TOKEN_WORD;
+}
+
+/**
+ * Append a word to the argv of a stage, doubling the array in the arena
+ */
+static void stage_push(struct arena *arena, struct command_t *stage, int *capacity, char *word)
+{
+	int count=stage->arg_count+1; // argv[0] is the name
+	if (count+1>*capacity)
+	{
+		int grown=*capacity?*capacity*2:8;
+		char **argv=arena_alloc(arena, sizeof(char *)*grown);
+		if (count>0)
+			memcpy(argv, stage->argv, sizeof(char *)*count);
+		stage->argv=argv;
+		*capacity=grown;
 	}
-	while (len>0 && strchr(splitters, buf[len-1])!=NULL)
-		buf[--len]=0; // trim right whitespace
+	stage->argv[count]=word;
+	stage->argv[count+1]=NULL;
+	stage->arg_count++;
+}
+
+/**
+ * Parse a command string into a command struct
+ * @param  buf     the line, not modified
+ * @param  command zeroed first stage, owner of the arena
+ * @return         0, -1 after printing a syntax error
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+	double start=trace_now();
+	size_t len=strlen(buf);
+	struct arena *arena=&command->arena;
+	arena->block_size=2*len+1024; // the copy, argv arrays and stages
+	char *line=arena_alloc(arena, len+1);
+	memcpy(line, buf, len+1);
 
-	if (len>0 && buf[len-1]=='?') // auto-complete
+	while (len>0 && (line[len-1]==' ' || line[len-1]=='\t'))
+		len--;
+	if (len>0 && line[len-1]=='?') // auto-complete
 		command->auto_complete=true;
-	if (len>0 && buf[len-1]=='&') // background
-		command->background=true;
 
-	char *pch = strtok(buf, splitters);
-	command->name=(char *)malloc(strlen(pch)+1);
-	if (pch==NULL)
-		command->name[0]=0;
-	else
-		strcpy(command->name, pch);
+	struct lexer lex={ line, 0 };
+	struct command_t *stage=command;
+	int capacity=0, type;
+	char *word;
+	const char *error=NULL;
+	stage->name=NULL;
+	while (error==NULL && (type=next_token(&lex, &word))!=TOKEN_END)
+	{
+		switch (type)
+		{
+		case TOKEN_WORD:
+			if (stage->name==NULL)
+			{
+				stage->name=word;
+				stage->arg_count=-1; // the name takes argv[0]
+			}
+			stage_push(arena, stage, &capacity, word);
+			break;
+		case TOKEN_PIPE:
+			if (stage->name==NULL)
+			{
+				error="|";
+				break;
+			}
+			stage->next=arena_alloc(arena, sizeof(struct command_t));
+			memset(stage->next, 0, sizeof(struct command_t));
+			stage=stage->next;
+			capacity=0;
+			break;
+		case TOKEN_AMP:
+			command->background=true;
+			stage->background=true;
+			break;
+		case TOKEN_IN:
+		case TOKEN_OUT:
+		case TOKEN_APPEND:
+			if (next_token(&lex, &word)!=TOKEN_WORD)
+				error=type==TOKEN_IN?"<":type==TOKEN_OUT?">":">>";
+			else
+				stage->redirects[type-TOKEN_IN]=word;
+			break;
+		default:
+			error="unterminated quote";
+		}
+	}
+	if (error==NULL && stage->name==NULL && stage!=command)
+		error="|";
+	if (error) // run nothing, like an empty line
+	{
+		printf("-%s: syntax error near %s\n", sysname, error);
+		memset(command->redirects, 0, sizeof(command->redirects));
+		command->next=NULL;
+		command->background=false;
+		command->name=NULL;
+	}
+	for (struct command_t *c=command;c;c=c->next)
+	{
+		if (c->name==NULL) // empty line
+		{
+			c->name=line+len;
+			*c->name=0;
+			c->arg_count=-1;
+			capacity=0;
+			stage_push(arena, c, &capacity, c->name);
+		}
+		c->args=c->argv+1;
+	}
+	if (tracing())
+	{
+		char detail[32];
+		snprintf(detail, sizeof(detail), "%zu bytes", len);
+		trace_event("parse", 'X', start, trace_now()-start, 0, 0, detail);
+	}
+	return error?-1:0;
+}
+
+void prompt_backspace()
+{
+	putchar(8); // go back 1
+	putchar(' '); // write empty over
+	putchar(8); // go back 1 again
+}
+/**
+ * Wait for a key, reaping the jobs that finish in the meantime
+ * @return the key, EOF when the input is closed
+ */
+static int prompt_getc(void)
+{
+	unsigned char key;
+	while (shell_poll(STDIN_FILENO, -1)==0)
+		;
+	return read(STDIN_FILENO, &key, 1)==1?key:EOF;
+}
 
-	command->args=(char **)malloc(sizeof(char *));
+/**
+ * Replace the line on the screen with the prompt and buf
+ */
+static void prompt_redraw(const char *buf, int len)
+{
+	printf("\r\33[K");
+	show_prompt();
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+}
 
-	int redirect_index;
-	int arg_index=0;
-	char temp_buf[1024], *arg;
+/**
+ * Incremental reverse search, started with Ctrl+R
+ * Every key refines the query and searches again from the current match,
+ * Ctrl+R goes on to older matches, Ctrl+G gives up, enter runs the match
+ * and any other key leaves it in the line for editing.
+ * @return 1 if the match should run right away
+ */
+static int prompt_search(char *buf, int *index, size_t size)
+{
+	char query[256];
+	size_t qlen=0;
+	long match=-1;
+	size_t match_len=0;
+	const char *entry="";
+	int c;
 	while (1)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch) break;
-		arg=temp_buf;
-		strcpy(arg, pch);
-		len=strlen(arg);
+		printf("\r\33[K(%sreverse-i-search)`%.*s': %.*s", qlen>0 && match==-1?"failed ":"",
+			(int)qlen, query, (int)match_len, entry);
+		fflush(stdout);
 
-		if (len==0) continue; // empty arg, go for next
-		while (len>0 && strchr(splitters, arg[0])!=NULL) // trim left whitespace
+		c=prompt_getc();
+		long from=history_count();
+		if (c==EOF || c==7) // Ctrl+G, back to the line as it was
 		{
-			arg++;
-			len--;
+			prompt_redraw(buf, *index);
+			return 0;
 		}
-		while (len>0 && strchr(splitters, arg[len-1])!=NULL) arg[--len]=0; // trim right whitespace
-		if (len==0) continue; // empty arg, go for next
-
-		// piping to another command
-		if (strcmp(arg, "|")==0)
+		if (c=='\n' || c==27 || c==9 || (c<32 && c!=18))
+			break;
+		if (c==18) // older match
+			from=match>=0?match:from;
+		else if (c==127)
 		{
-			struct command_t *c=malloc(sizeof(struct command_t));
-			int l=strlen(pch);
-			pch[l]=splitters[0]; // restore strtok termination
-			index=1;
-			while (pch[index]==' ' || pch[index]=='\t') index++; // skip whitespaces
-
-			parse_command(pch+index, c);
-			pch[l]=0; // put back strtok termination
-			command->next=c;
+			if (qlen>0)
+				qlen--;
+		}
+		else if (qlen<sizeof(query))
+		{
+			query[qlen++]=c;
+			from=match>=0?match+1:from; // the current match may still do
+		}
+		if (qlen==0)
+		{
+			match=-1;
 			continue;
 		}
+		if (match==-1 && c!=127 && c!=18 && qlen>1) // a longer query fails as well
+			continue;
+		long found=history_search(query, qlen, from);
+		if (found>=0 || c!=18)
+			match=found;
+		if (match>=0)
+			entry=history_get(match, &match_len);
+		else
+			match_len=0;
+	}
 
-		// background process
-		if (strcmp(arg, "&")==0)
-			continue; // handled before
+	if (match>=0)
+	{
+		*index=match_len<size-1?match_len:size-2;
+		memcpy(buf, entry, *index);
+	}
+	prompt_redraw(buf, *index);
+	return c=='\n' && match>=0 && buf[0];
+}
 
-		// handle input redirection
-		redirect_index=-1;
-		if (arg[0]=='<')
-			redirect_index=0;
-		if (arg[0]=='>')
+/**
+ * Complete the word before the cursor, started with Tab
+ * A single match is inserted whole, several are extended to their common
+ * prefix and listed when that does not add anything.
+ * @return the new length of the line
+ */
+static int prompt_complete(char *buf, int index, size_t size)
+{
+	//find where the last word starts, and whether it names a command
+	int start=index, words=0;
+	bool in_word=false, redirect=false;
+	char quote=0;
+	for (int i=0;i<index;++i)
+	{
+		char c=buf[i];
+		if (quote)
 		{
-			if (len>1 && arg[1]=='>')
-			{
-				redirect_index=2;
-				arg++;
-				len--;
-			}
-			else redirect_index=1;
+			if (c==quote)
+				quote=0;
+			else if (c=='\\' && quote=='"')
+				i++;
+			continue;
 		}
-		if (redirect_index != -1)
+		if (c==' ' || c=='\t' || is_operator(c))
 		{
-			command->redirects[redirect_index]=malloc(len);
-			strcpy(command->redirects[redirect_index], arg+1);
+			if (in_word && !redirect)
+				words++;
+			else if (in_word)
+				redirect=false;
+			in_word=false;
+			if (c=='|' || c=='&')
+				words=0;
+			if (c=='<' || c=='>')
+				redirect=true;
 			continue;
 		}
+		if (!in_word)
+			start=i;
+		in_word=true;
+		if (c=='\'' || c=='"')
+			quote=c;
+		else if (c=='\\')
+			i++;
+	}
+	if (!in_word)
+		start=index;
+
+	//the word as the lexer will see it
+	char word[PATH_MAX];
+	size_t len=0;
+	quote=0;
+	for (int i=start;i<index && len<sizeof(word)-1;++i)
+	{
+		char c=buf[i];
+		if (quote==0 && (c=='\'' || c=='"'))
+			quote=c;
+		else if (c==quote)
+			quote=0;
+		else if (c=='\\' && i+1<index && (quote==0 ||
+			(quote=='"' && strchr("\"\\$`", buf[i+1]))))
+			word[len++]=buf[++i];
+		else
+			word[len++]=c;
+	}
+	word[len]=0;
 
-		// normal arguments
-		if (len>2 && ((arg[0]=='"' && arg[len-1]=='"')
-			|| (arg[0]=='\'' && arg[len-1]=='\''))) // quote wrapped arg
+	struct completion result;
+	memset(&result, 0, sizeof(result));
+	completion_find(word, words==0 && !redirect, &result);
+	if (result.total==0)
+		putchar('\a');
+	else if (result.common>len)
+	{
+		const char *name=result.names[0];
+		for (size_t i=len;i<result.common && index<(int)size-3;++i)
+		{
+			if (quote==0 && strchr(" \t'\"\\|&<>", name[i]))
+				buf[index++]='\\';
+			else if (quote=='"' && strchr("\"\\$`", name[i]))
+				buf[index++]='\\';
+			buf[index++]=name[i];
+		}
+		if (result.total==1 && name[result.common-1]!='/' && index<(int)size-3)
 		{
-			arg[--len]=0;
-			arg++;
+			if (quote)
+				buf[index++]=quote;
+			buf[index++]=' ';
 		}
-		command->args=(char **)realloc(command->args, sizeof(char *)*(arg_index+1));
-		command->args[arg_index]=(char *)malloc(len+1);
-		strcpy(command->args[arg_index++], arg);
+		prompt_redraw(buf, index);
 	}
-	command->arg_count=arg_index;
-	return 0;
+	else if (result.total>1)
+	{
+		putchar('\n');
+		completion_print(&result);
+		prompt_redraw(buf, index);
+	}
+	fflush(stdout);
+	arena_free(&result.arena);
+	return index;
 }
 
-void prompt_backspace()
-{
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
-}
 /**
  * Prompt a command from the user
  * @param  buf      [description]
@@ -221,22 +756,30 @@ void prompt_backspace()
 int prompt(struct command_t *command)
 {
 	int index=0;
-	char c;
+	int c;
 	char buf[4096];
-	static char oldbuf[4096];
+	char typed[4096]; // the line being typed while browsing the history
+	int typed_len=0;
+	long hist_pos=history_count(); // entry shown, history_count() for the typed line
 
     // tcgetattr gets the parameters of the current terminal
     // STDIN_FILENO will tell tcgetattr that it should write the settings
     // of stdin to oldt
     static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    static int tty=-1; // piped input has no terminal to set up
+    if (tty==-1)
+        tty=isatty(STDIN_FILENO);
+    if (tty)
+    {
+        tcgetattr(STDIN_FILENO, &backup_termios);
+        new_termios = backup_termios;
+        // ICANON normally takes care that one line at a time will be processed
+        // that means it will return if it sees a "\n" or an EOF or an EOL
+        new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+        // Those new settings will be set to STDIN
+        // TCSANOW tells tcsetattr to change attributes immediately.
+        tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    }
 
 
     //FIXME: backspace is applied before printing chars
@@ -245,13 +788,20 @@ int prompt(struct command_t *command)
 	buf[0]=0;
   	while (1)
   	{
-		c=getchar();
+		c=prompt_getc();
+		if (c==EOF) // input closed, same as Ctrl+D
+		{
+			if (tty)
+				tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
 		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
 
 		if (c==9) // handle tab
 		{
-			buf[index++]='?'; // autocomplete
-			break;
+			multicode_state=0;
+			index=prompt_complete(buf, index, sizeof(buf));
+			continue;
 		}
 
 		if (c==127) // handle backspace
@@ -263,6 +813,16 @@ int prompt(struct command_t *command)
 			}
 			continue;
 		}
+		if (c==18) // Ctrl+R, reverse search of the history
+		{
+			if (prompt_search(buf, &index, sizeof(buf)))
+			{
+				putchar('\n');
+				break;
+			}
+			hist_pos=history_count();
+			continue;
+		}
 		if (c==27 && multicode_state==0) // handle multi-code keys
 		{
 			multicode_state=1;
@@ -273,26 +833,47 @@ int prompt(struct command_t *command)
 			multicode_state=2;
 			continue;
 		}
-		if (c==65 && multicode_state==2) // up arrow
+		if ((c==65 || c==66) && multicode_state==2) // up and down arrows
 		{
-			int i;
-			while (index>0)
+			multicode_state=0;
+			long count=history_count();
+			if (hist_pos>count)
+				hist_pos=count;
+			if (hist_pos==count) // leaving the typed line, keep it
 			{
-				prompt_backspace();
-				index--;
+				memcpy(typed, buf, index);
+				typed_len=index;
+			}
+			if (c==65 && hist_pos>0)
+				hist_pos--;
+			else if (c==66 && hist_pos<count)
+				hist_pos++;
+			else
+				continue;
+			if (hist_pos==count)
+			{
+				memcpy(buf, typed, typed_len);
+				index=typed_len;
 			}
-			for (i=0;oldbuf[i];++i)
+			else
 			{
-				putchar(oldbuf[i]);
-				buf[i]=oldbuf[i];
+				size_t len;
+				const char *entry=history_get(hist_pos, &len);
+				index=len<sizeof(buf)-1?len:sizeof(buf)-2;
+				memcpy(buf, entry, index);
 			}
-			index=i;
+			prompt_redraw(buf, index);
 			continue;
 		}
-		else
+		if (multicode_state==2) // other escape sequences are not handled
+		{
 			multicode_state=0;
+			continue;
+		}
+		multicode_state=0;
 
 		putchar(c); // echo the character
+		fflush(stdout); // stdin is read unbuffered, the echo must keep up
 		buf[index++]=c;
 		if (index>=sizeof(buf)-1) break;
 		if (c=='\n') // enter key
@@ -304,54 +885,229 @@ int prompt(struct command_t *command)
   		index--;
   	buf[index++]=0; // null terminate string
 
-  	strcpy(oldbuf, buf);
+	if (tty && buf[0])
+		history_add(buf);
 
   	parse_command(buf, command);
 
   	// print_command(command); // DEBUG: uncomment for debugging
 
     // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	if (tty)
+		tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
   	return SUCCESS;
 }
 int process_command(struct command_t *command);
-int process_command(struct command_t *command);
-int uniq_func(int flag);
-int wiseman_func(int numb);
+int myuniq_func(struct command_t *command, int in_fd, FILE *out);
+int uniq_file_func(const char *file, int flag, FILE *out);
+int wiseman_function(int min);
 int pipe_execute(struct command_t *command);
+bool is_builtin(const char *name);
+void give_terminal(pid_t pgid);
+void apply_redirects(struct command_t *command);
+void print_pipe_status(void);
+void jobs_init(void);
+void jobs_wake(void);
+void jobs_notify(void);
+int jobs_func(struct command_t *command);
+int fg_func(struct command_t *command, bool foreground);
+int wait_func(struct command_t *command);
+int parallel_func(struct command_t *command);
+void jobs_forked(void);
+int every_func(struct command_t *command);
+int sched_func(struct command_t *command);
+int sched_add(const char *line, int64_t delay, int64_t period);
+int sched_fd(void);
+void sched_fire(void);
+void sched_forked(void);
+int time_func(struct command_t *command);
+int stats_func(struct command_t *command);
+int stats_set(const char *mode);
+int stats_process_command(struct command_t *command);
+extern int shell_status;
+int set_launch_mode(const char *name);
+int set_builtin_threads(const char *mode);
+const char *get_launch_mode(void);
 long long timeInMilliseconds(void);
-int main()
-{
-	while (1)
-	{
-		struct command_t *command=malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-		int code;
-		code = prompt(command);
-		if (code==EXIT) break;
-
-		code = process_command(command);
-		if (code==EXIT) break;
-
-		free_command(command);
-	}
+char *path_cache_lookup(const char *name);
+void path_cache_clear(void);
+void path_cache_print(void);
+/*
+	Scripts and -c strings are read in large blocks and split into lines
+	here, without the terminal setup and prompt of the interactive loop.
+	Blank lines and lines starting with # are skipped, so a #! line works.
+*/
+#define SCRIPT_BLOCK (1<<16)
 
-	printf("\n");
-	return 0;
+/**
+ * Run one line of a script
+ * @return EXIT once the script should stop
+ */
+static int script_line(char *line)
+{
+	while (*line==' ' || *line=='\t')
+		line++;
+	if (*line==0 || *line=='#')
+		return SUCCESS;
+	struct command_t *command=malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	shell_status=0;
+	if (parse_command(line, command)==-1)
+		shell_status=2;
+	int code=stats_process_command(command);
+	if (code==UNKNOWN)
+		shell_status=127;
+	free_command(command);
+	jobs_notify(); // drop the background jobs that finished, silently
+	return code==EXIT?EXIT:SUCCESS;
 }
 
-int process_command(struct command_t *command)
+/**
+ * Run every line of a string, the argument of -c
+ * @return exit status of the last command
+ */
+int run_string(char *text)
 {
-	int r;
-	if (strcmp(command->name, "")==0) return SUCCESS;
-
-	if (strcmp(command->name, "exit")==0)
-		return EXIT;
+	interactive=false;
+	char *save, *line;
+	for (line=strtok_r(text, "\n", &save);line;line=strtok_r(NULL, "\n", &save))
+		if (script_line(line)==EXIT)
+			break;
+	return shell_status;
+}
 
-	if (strcmp(command->name, "cd")==0)
+/**
+ * Run a script read from fd in blocks of SCRIPT_BLOCK bytes
+ * The commands keep the shell's own stdin, the script is only read here.
+ * @return exit status of the last command
+ */
+int run_script(int fd)
+{
+	interactive=false;
+	size_t size=SCRIPT_BLOCK, have=0;
+	char *buf=malloc(size+1);
+	bool done=false;
+	while (!done)
 	{
-		if (command->arg_count > 0)
+		if (have==size) // a line longer than the buffer
+		{
+			size*=2;
+			buf=realloc(buf, size+1);
+		}
+		ssize_t n=read(fd, buf+have, size-have);
+		if (n==-1 && errno==EINTR)
+			continue;
+		if (n<=0)
+		{
+			n=0;
+			done=true;
+			if (have>0)
+				buf[have++]='\n'; // a last line without newline
+		}
+		have+=n;
+
+		char *start=buf, *nl;
+		while ((nl=memchr(start, '\n', buf+have-start))!=NULL)
+		{
+			*nl=0;
+			if (script_line(start)==EXIT)
+			{
+				done=true;
+				break;
+			}
+			start=nl+1;
+		}
+		have-=start-buf;
+		memmove(buf, start, have);
+	}
+	free(buf);
+	return shell_status;
+}
+
+#ifndef SHELLAX_NO_MAIN // shellax-bench.c includes the shell without its main
+int main(int argc, char **argv)
+{
+	signal(SIGTTOU, SIG_IGN); // the shell takes the terminal back from finished jobs
+	jobs_init();
+	if (getenv("SHELLAX_STATS") && stats_set(getenv("SHELLAX_STATS"))==-1)
+		fprintf(stderr, "-%s: SHELLAX_STATS: use on or off\n", sysname);
+	if (getenv("SHELLAX_LAUNCH") && set_launch_mode(getenv("SHELLAX_LAUNCH"))==-1)
+		fprintf(stderr, "-%s: SHELLAX_LAUNCH: unknown mode %s\n", sysname, getenv("SHELLAX_LAUNCH"));
+	if (getenv("SHELLAX_TRACE") && trace_open(getenv("SHELLAX_TRACE"))==-1)
+		fprintf(stderr, "-%s: SHELLAX_TRACE: %s: %s\n", sysname, getenv("SHELLAX_TRACE"), strerror(errno));
+	if (getenv("SHELLAX_BUILTIN_THREADS") && set_builtin_threads(getenv("SHELLAX_BUILTIN_THREADS"))==-1)
+		fprintf(stderr, "-%s: SHELLAX_BUILTIN_THREADS: use on or off\n", sysname);
+
+	if (argc>1 && strcmp(argv[1], "-c")==0)
+	{
+		if (argc<3)
+		{
+			fprintf(stderr, "-%s: -c: option requires an argument\n", sysname);
+			return 2;
+		}
+		return run_string(argv[2]);
+	}
+	if (argc>1)
+	{
+		int fd=open(argv[1], O_RDONLY|O_CLOEXEC);
+		if (fd==-1)
+		{
+			fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+			return 127;
+		}
+		int status=run_script(fd);
+		close(fd);
+		return status;
+	}
+
+	completion_start();
+	while (1)
+	{
+		struct command_t *command=malloc(sizeof(struct command_t));
+		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+
+		int code;
+		jobs_notify();
+		code = prompt(command);
+		if (code==EXIT) break;
+
+		code = stats_process_command(command);
+		if (code==EXIT) break;
+
+		free_command(command);
+	}
+
+	printf("\n");
+	return 0;
+}
+#endif
+
+static int run_command(struct command_t *command);
+
+int process_command(struct command_t *command)
+{
+	if (!tracing() || command->name==NULL)
+		return run_command(command);
+	double start=trace_now();
+	int code=run_command(command);
+	trace_event(command->name[0]?command->name:"empty line", 'X', start, trace_now()-start, 0, 0, "process_command");
+	return code;
+}
+
+static int run_command(struct command_t *command)
+{
+	int r;
+	if (strcmp(command->name, "")==0) return SUCCESS;
+
+	if (command->auto_complete)
+		return complete_func(command);
+
+	if (strcmp(command->name, "exit")==0)
+		return EXIT;
+
+	if (strcmp(command->name, "cd")==0)
+	{
+		if (command->arg_count > 0)
 		{
 			r=chdir(command->args[0]);
 			if (r==-1)
@@ -360,10 +1116,73 @@ int process_command(struct command_t *command)
 		}
 	}
 	
+	if (strcmp(command->name, "hash")==0)
+	{
+		if (command->arg_count>0 && strcmp(command->args[0], "-r")==0)
+		{
+			path_cache_clear();
+			completion_rescan();
+		}
+		else if (command->arg_count>0)
+		{
+			for (int i=0;i<command->arg_count;++i)
+			{
+				char *path=path_cache_lookup(command->args[i]);
+				if (path==NULL)
+					printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+				free(path);
+			}
+		}
+		else
+			path_cache_print();
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "launchmode")==0)
+	{
+		if (command->arg_count==0)
+			printf("%s\n", get_launch_mode());
+		else if (set_launch_mode(command->args[0])==-1)
+			printf("-%s: %s: %s: unknown mode, use fork, spawn or zygote\n", sysname, command->name, command->args[0]);
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "pipestatus")==0)
+	{
+		print_pipe_status();
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "jobs")==0)
+		return jobs_func(command);
+
+	if (strcmp(command->name, "fg")==0 || strcmp(command->name, "bg")==0)
+		return fg_func(command, command->name[0]=='f');
+
+	if (strcmp(command->name, "wait")==0)
+		return wait_func(command);
+
+	if (strcmp(command->name, "parallel")==0 && command->next==NULL)
+		return parallel_func(command);
+
+	if (strcmp(command->name, "every")==0 || strcmp(command->name, "at")==0)
+		return every_func(command);
+
+	if (strcmp(command->name, "sched")==0)
+		return sched_func(command);
+
+	if (strcmp(command->name, "time")==0 && command->arg_count>0)
+		return time_func(command);
+
+	if (strcmp(command->name, "stats")==0)
+		return stats_func(command);
+
 	if (strcmp(command->name, "chatroom")==0)
 	{
-		if(command->arg_count==2){
-			chatroom_func(command->args[0],command->args[1]);
+		struct chat_options options;
+		char *room_name, *user_name;
+		if(chat_parse_options(command,&options,&room_name,&user_name)==0){
+			chatroom_func(room_name,user_name,&options);
 			return SUCCESS;
 		}
 		else {
@@ -376,16 +1195,8 @@ int process_command(struct command_t *command)
         	return pipe_execute(command);
 	}
 
-	if (strcmp(command->name, "myuniq")==0){
-		if(command -> args[0] == NULL){
-			uniq_func(0);
-		}else if((strcmp(command->args[0],"-c")== 0) || (strcmp(command -> args[0],"--count") == 0)){
-			uniq_func(1);
-		}else{
-		
-		}
-		return SUCCESS;
-	}
+	if (strcmp(command->name, "myuniq")==0)
+		return myuniq_func(command, STDIN_FILENO, stdout);
 	if (strcmp(command->name, "wiseman")==0){
 			if(command -> arg_count != 1){
 				printf("Wrong number of arguments");
@@ -397,10 +1208,18 @@ int process_command(struct command_t *command)
 
 	if (strcmp(command->name, "vigenere")==0)
 	{
+		if(command->arg_count>=1 && command->arg_count<=2 && strcmp(command->args[0],"crack")==0){
+			vigenere_crack_func(command->arg_count==2?command->args[1]:NULL,STDIN_FILENO,stdout);
+			return SUCCESS;
+		}
 		if(command->arg_count==3){
 			vigenere_func(command->args[0],command->args[1],command->args[2]);
 			return SUCCESS;
 		}
+		else if(command->arg_count==2){
+			vigenere_stream_func(command->args[0],command->args[1],STDIN_FILENO,STDOUT_FILENO);
+			return SUCCESS;
+		}
 		else {
 			printf("%s\n","Wrong number of arguments!");
 			return EXIT;
@@ -412,400 +1231,5260 @@ int process_command(struct command_t *command)
 			return SUCCESS;
 	}
 
-	pid_t pid=fork();
-	if (pid==0) // child
-	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-	    // extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
+	//external commands run as a pipeline of one stage
+	return pipe_execute(command);
+}
 
-		// increase args size by 2
-		command->args=(char **)realloc(
-			command->args, sizeof(char *)*(command->arg_count+=2));
 
-		// shift everything forward by 1
-		for (int i=command->arg_count-2;i>0;--i)
-			command->args[i]=command->args[i-1];
+///History
+/*
+	The history is a text file of one command per line, ~/.shellax_history
+	or SHELLAX_HISTORY, next to an index of the uint64 offset where each
+	entry starts. Both are mapped read only and mapped again when another
+	session made them grow. Sessions append under a flock on the text
+	file, the text first and then its offset, so every indexed entry is
+	complete; an index that does not match its text is rebuilt on open.
+	Reverse search walks the text backwards in blocks of HISTORY_BLOCK
+	bytes and only reads the blocks the filters can not rule out. A bitmap
+	of every byte pair and triple in the history answers most misses
+	without reading any block. Every group of 64 blocks has an exact
+	bitmap of its byte pairs, so groups without the pairs of the query
+	are skipped whole. Within a group, the pairs and triples starting in
+	a block set two of HISTORY_BINS bins each; a match starting in a block
+	has its first triple (its pair for two bytes) in that block and the
+	others in it or the next one. A block of command text sets about a
+	sixth of the bins. The bins are stored bit-sliced, one word per bin
+	with a bit per block of the group, so a search ANDs a few words for
+	64KB of text. Runs of blocks left over are read with one memmem each.
+	The filters take about 1.1 bytes per byte of text. On a million
+	entries a search takes microseconds, except for a miss made only of
+	pairs and triples that are in nearly every block; that one reads the
+	text, a few milliseconds (shellax-bench history). The offset of a
+	match becomes an entry with a binary search over the index.
+*/
+#define HISTORY_BLOCK 1024
+#define HISTORY_BIN_BITS 13
+#define HISTORY_BINS (1<<HISTORY_BIN_BITS)
+#define HISTORY_GROUP (64*HISTORY_BLOCK) // text covered by one word of each bin
+#define HISTORY_SEEN (1u<<25) // triples, then pairs
 
-		// set args[0] as a copy of name
-		command->args[0]=strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count-1]=NULL;
+struct history {
+	bool opened;
+	int fd, idx_fd;
+	const char *text;
+	size_t text_size;
+	const uint64_t *offsets;
+	size_t count;
+	uint64_t (*filters)[HISTORY_BINS]; // per group of 64 blocks, bit b of a bin is block b of the group
+	size_t filtered; // bytes of text covered by the filters
+	uint64_t (*pairs)[1024]; // per group, a bit for each of the 65536 byte pairs in it
+	uint64_t *seen; // HISTORY_SEEN bits, one per pair and triple anywhere in the text
+};
 
-		
-		//Handle the redirection issue
-		int fw;
-		if(command -> redirects[0] != NULL){
-			fw=open(command -> redirects[0], O_RDONLY, S_IRUSR | S_IWUSR);
-			dup2(fw,0);
-		}
+static struct history history={ .fd=-1, .idx_fd=-1 };
 
-		if(command -> redirects[1] != NULL){
-			fw=open(command -> redirects[1], O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR | S_IWUSR);
-			dup2(fw,1);
-		}
+/**
+ * The two bins of the pair, or of the triple when n is 3, starting at p
+ * @return the pair or triple itself, its bit in history.seen
+ */
+static uint32_t history_gram(const unsigned char *p, int n, unsigned int bins[2])
+{
+	uint32_t v=n==3?(uint32_t)(p[0]<<16|p[1]<<8|p[2]):1u<<24|p[0]<<8|p[1];
+	bins[0]=(v*0x9E3779B1u)>>(32-HISTORY_BIN_BITS);
+	bins[1]=(v*0x85EBCA77u)>>(32-HISTORY_BIN_BITS);
+	return v;
+}
 
-		if(command -> redirects[2] != NULL){
-			fw=open(command -> redirects[2], O_APPEND|O_WRONLY|O_CREAT, S_IRUSR | S_IWUSR);
-			dup2(fw,1);
+/**
+ * Extend the filters over the text appended since the last call
+ */
+static void history_filter(void)
+{
+	size_t groups=(history.text_size+HISTORY_GROUP-1)/HISTORY_GROUP;
+	size_t old_groups=(history.filtered+HISTORY_GROUP-1)/HISTORY_GROUP;
+	history.filters=realloc(history.filters, (groups?groups:1)*sizeof(*history.filters));
+	history.pairs=realloc(history.pairs, (groups?groups:1)*sizeof(*history.pairs));
+	//the block of the last triple seen may have grown, and its triples with it
+	size_t from=(history.filtered>2?history.filtered-2:0)/HISTORY_BLOCK*HISTORY_BLOCK;
+	size_t first=from/HISTORY_GROUP;
+	if (first<old_groups) // keep the bits of the blocks before from
+	{
+		uint64_t keep=(1ull<<(from/HISTORY_BLOCK%64))-1;
+		for (int bin=0;bin<HISTORY_BINS;++bin)
+			history.filters[first][bin]&=keep;
+		first++;
+	}
+	if (first<groups)
+		memset(history.filters[first], 0, (groups-first)*sizeof(*history.filters));
+	//the pairs of a group only gain bits, the text before from is unchanged
+	size_t fresh=from==0?0:old_groups;
+	if (fresh<groups)
+		memset(history.pairs[fresh], 0, (groups-fresh)*sizeof(*history.pairs));
+	if (history.seen==NULL) // 4MB, only the pages of grams in use are touched
+		history.seen=mmap(NULL, HISTORY_SEEN/8, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	else if (from==0 && history.seen!=MAP_FAILED)
+		madvise(history.seen, HISTORY_SEEN/8, MADV_DONTNEED); // zero again
+	const unsigned char *text=(const unsigned char *)history.text;
+	for (size_t i=from;i+1<history.text_size;++i)
+	{
+		uint64_t *filter=history.filters[i/HISTORY_GROUP];
+		uint64_t bit=1ull<<(i/HISTORY_BLOCK%64);
+		unsigned int bins[2], pair=text[i]<<8|text[i+1];
+		history.pairs[i/HISTORY_GROUP][pair>>6]|=1ull<<(pair&63);
+		for (int n=2;n<=3 && i+n<=history.text_size;++n)
+		{
+			uint32_t v=history_gram(text+i, n, bins);
+			if (history.seen!=MAP_FAILED)
+				history.seen[v>>6]|=1ull<<(v&63);
+			filter[bins[0]]|=bit;
+			filter[bins[1]]|=bit;
 		}
+	}
+	history.filtered=history.text_size;
+}
 
-		//execvp is removed
-		//execvp(command->name, command->args); // exec+args+path
-
-		/// TODO: do your own exec with path resolving using execv()
-
-		//global variable PATH is read and program has gotten all the paths
-		char* PATH = getenv("PATH");											
+static void history_unmap(void)
+{
+	if (history.text)
+		munmap((void *)history.text, history.text_size);
+	if (history.offsets)
+		munmap((void *)history.offsets, history.count*sizeof(uint64_t));
+	history.text=NULL;
+	history.offsets=NULL;
+	history.text_size=history.count=0; // the filters stay, the text only grows
+}
 
-		char *unit_path;
-		const char s[2] = ":";
-		char *d = "/";
-   
-		//tokenize path by dividing ":" assigned to s variable.
-		//unit_path is the first token 
-		unit_path = strtok(PATH, s);
-		//it tries all the tokens, unit_path, until it executes successfully.
-		while( unit_path != NULL ) {
-			char* pathw_cmd = malloc(strlen(unit_path)+strlen(d)+strlen(command->name)+1); 	//memory allocation for char array concat process
-			
-			strcpy(pathw_cmd, unit_path); 											//first part is copied to pathw_cmd
-			strcat(pathw_cmd, d);													//"/" is concatenated
-			strcat(pathw_cmd, command->name); 										//command name is concatenated to pathw_cmd
-			//printf("looking for command in: %s\n",pathw_cmd);
-			if(execv(pathw_cmd,command->args)!=-1){									//if path input in execv includes that command it executes and exits.
-				exit(0);
-			}										
-			free(pathw_cmd);														//memory allocation freed
-			unit_path = strtok(NULL, s);											//if execv does not work, it tries next path
+/**
+ * Write the index again from the text, called with the lock held
+ */
+static void history_rebuild(void)
+{
+	history_unmap();
+	struct stat st;
+	if (fstat(history.fd, &st)==-1 || ftruncate(history.idx_fd, 0)==-1)
+		return;
+	char *text=st.st_size>0?mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0):NULL;
+	if (text==MAP_FAILED)
+		return;
+	uint64_t batch[4096];
+	size_t n=0;
+	for (size_t off=0;off<(size_t)st.st_size;)
+	{
+		batch[n++]=off;
+		const char *nl=memchr(text+off, '\n', st.st_size-off);
+		off=nl?(size_t)(nl-text)+1:(size_t)st.st_size;
+		if (n==sizeof(batch)/sizeof(batch[0]) || off==(size_t)st.st_size)
+		{
+			write(history.idx_fd, batch, n*sizeof(uint64_t));
+			n=0;
 		}
 	}
-	else
+	if (text)
+		munmap(text, st.st_size);
+}
+
+/**
+ * Map the history again if it changed since the last call
+ */
+static void history_sync(void)
+{
+	if (!history.opened)
 	{
-    // TODO: implement background processes here
-		//It waits for the specific pid, if the process is not background one.
-		if((command->background)==false){
-			waitpid(pid,NULL,NULL);
+		history.opened=true;
+		char path[PATH_MAX];
+		const char *file=getenv("SHELLAX_HISTORY");
+		if (file==NULL)
+		{
+			snprintf(path, sizeof(path), "%s/.shellax_history", getenv("HOME")?getenv("HOME"):".");
+			file=path;
 		}
-		return SUCCESS;
+		char idx_path[PATH_MAX+8];
+		snprintf(idx_path, sizeof(idx_path), "%s.idx", file);
+		history.fd=open(file, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+		history.idx_fd=open(idx_path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+		if (history.fd==-1 || history.idx_fd==-1)
+			return;
+		//a crash between the two writes of an append leaves them out of step
+		struct stat st, idx_st;
+		uint64_t last=0;
+		flock(history.fd, LOCK_EX);
+		fstat(history.fd, &st);
+		fstat(history.idx_fd, &idx_st);
+		size_t count=idx_st.st_size/sizeof(uint64_t);
+		if (count>0)
+			pread(history.idx_fd, &last, sizeof(last), (count-1)*sizeof(uint64_t));
+		if (idx_st.st_size%sizeof(uint64_t) || (count==0)!=(st.st_size==0) || last>=(uint64_t)st.st_size+(count==0))
+			history_rebuild();
+		flock(history.fd, LOCK_UN);
 	}
+	if (history.fd==-1 || history.idx_fd==-1)
+		return;
 
-	// TODO: your implementation here
+	struct stat st, idx_st;
+	if (fstat(history.fd, &st)==-1 || fstat(history.idx_fd, &idx_st)==-1)
+		return;
+	size_t count=idx_st.st_size/sizeof(uint64_t);
+	if ((size_t)st.st_size==history.text_size && count==history.count)
+		return;
+	history_unmap();
+	if (count==0 || st.st_size==0)
+		return;
+	void *text=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+	void *offsets=mmap(NULL, count*sizeof(uint64_t), PROT_READ, MAP_SHARED, history.idx_fd, 0);
+	if (text==MAP_FAILED || offsets==MAP_FAILED)
+	{
+		if (text!=MAP_FAILED)
+			munmap(text, st.st_size);
+		if (offsets!=MAP_FAILED)
+			munmap(offsets, count*sizeof(uint64_t));
+		return;
+	}
+	history.text=text;
+	history.text_size=st.st_size;
+	history.offsets=offsets;
+	history.count=count;
+	if (history.filtered>history.text_size) // rebuilt shorter
+		history.filtered=0;
+}
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+/**
+ * Number of entries, also picks up the ones other sessions added
+ */
+long history_count(void)
+{
+	history_sync();
+	return history.count;
 }
 
+/**
+ * Entry i of the history, without its newline
+ * @param  len set to the length of the entry
+ * @return     the text of the entry, not NUL terminated
+ */
+const char *history_get(long i, size_t *len)
+{
+	if (i<0 || (size_t)i>=history.count || history.offsets[i]>=history.text_size)
+	{
+		*len=0;
+		return "";
+	}
+	const char *start=history.text+history.offsets[i];
+	const char *nl=memchr(start, '\n', history.text+history.text_size-start);
+	*len=nl?nl-start:history.text+history.text_size-start;
+	return start;
+}
 
-void chatroom_func(char *room_name, char *user_name){
-	/*
-		this part creates chatroom-room_name folder in the /tmp/ path. 
-	*/
-	char* cr_path_template = "/tmp/chatroom-";
-    
-    char* cr_path = malloc(strlen(cr_path_template)+strlen(room_name)+1);
-    strcpy(cr_path,cr_path_template);
-    strcat(cr_path,room_name);
-	//save the initial directory in the case of changing the dir
-    char cwd_init[256];
-    getcwd(cwd_init, sizeof(cwd_init));
-	//if the dir does not exist, it creates the dir
-    if(chdir(cr_path)==-1){
-        mkdir(cr_path);
-    }
-    char cwd_poss[256];
-    getcwd(cwd_poss, sizeof(cwd_poss));
-	//if cwd is changed, return back
-    if(strcmp(cwd_init,cwd_poss)){
-        chdir(cwd_init);
-    }
-    
-    printf("\nWelcome to %s!\n\n",room_name);
+/**
+ * Append a command line to the history, skipping a repeat of the last one
+ */
+void history_add(const char *line)
+{
+	history_sync();
+	if (history.fd==-1 || history.idx_fd==-1 || strchr(line, '\n'))
+		return;
+	size_t len=strlen(line), last_len;
+	const char *last=history_get(history.count-1, &last_len);
+	if (history.count>0 && last_len==len && memcmp(last, line, len)==0)
+		return;
 
-	//named pipe of the registered user is created.
-	char *slash = "/";
-	char *namedPipe = malloc(strlen(cr_path)+strlen(user_name)+strlen(slash)+1);
-	strcpy(namedPipe,cr_path);
-	strcat(namedPipe,slash);
-	strcat(namedPipe,user_name);
-	mkfifo(namedPipe, 0666);
-	
-	//prev will be used for temp memory of handling new message is gotten or not.
-	char prev[MAX_BUF];
+	flock(history.fd, LOCK_EX);
+	struct stat st;
+	if (fstat(history.fd, &st)==0)
+	{
+		uint64_t offset=st.st_size; // O_APPEND writes here, nobody else can under the lock
+		struct iovec iov[2]={ { (char *)line, len }, { "\n", 1 } };
+		if (writev(history.fd, iov, 2)==(ssize_t)len+1)
+			write(history.idx_fd, &offset, sizeof(offset));
+	}
+	flock(history.fd, LOCK_UN);
+}
 
-    pid_t p;
-	p=fork();
-	//parent process opens the user's named pipe and continously checks its pipe
-	//for new messages. When it confronts new message, it prints.
-	if(p==0){
-		int fd;
-		fd = open(namedPipe, O_RDWR | O_NONBLOCK);
-		while(1){
-			char *buf = malloc(MAX_BUF);
-			if(read(fd, buf, MAX_BUF)>0 && strcmp(prev,buf)!=0){
-				printf("[%s] %s\n", room_name,buf);
-				strcpy(prev,buf);
-			}  
-			free(buf);
+static bool history_seen(uint32_t v)
+{
+	return history.seen==MAP_FAILED || history.seen[v>>6]&1ull<<(v&63);
+}
+
+/**
+ * Find the newest entry older than before that contains query
+ * @return index of the entry, -1 if none
+ */
+long history_search(const char *query, size_t len, long before)
+{
+	history_sync();
+	if (len==0 || before<=0 || history.count==0)
+		return -1;
+	if (history.filtered!=history.text_size) // built on the first search
+		history_filter();
+	if ((size_t)before>history.count)
+		before=history.count;
+	size_t end=(size_t)before<history.count?history.offsets[before]:history.text_size;
+	if (len>end)
+		return -1;
+
+	//the bins of the first triple, or pair, of the query and the distinct
+	//bins of its other triples; a query that may reach past the next
+	//block is not filtered, every block is read for it
+	const unsigned char *q=(const unsigned char *)query;
+	int n=len>2?3:2;
+	unsigned int first[2]={ 0, 0 }, bins[64];
+	int bin_count=0;
+	if (len>1 && !history_seen(history_gram(q, n, first)))
+		return -1;
+	for (size_t i=1;i+n<=len && len<=HISTORY_BLOCK && bin_count+2<=64;++i)
+	{
+		unsigned int gram[2];
+		if (!history_seen(history_gram(q+i, n, gram)))
+			return -1; // not anywhere in the history
+		for (int k=0;k<2;++k)
+		{
+			int j=0;
+			while (j<bin_count && bins[j]!=gram[k])
+				j++;
+			if (j==bin_count)
+				bins[bin_count++]=gram[k];
 		}
-		close(fd);
-		
-	}
-	//child process waits for the input message of user.
-	//when the user writes smt to others, it iterates over files in the room directory and writes
-	//the message at each named pipe.
-	else{
-		while(1){
-			char message1[MAX_BUF];
-			fgets(message1, MAX_BUF, stdin);
-			printf("[%s] %s: %s\n", room_name,user_name,message1);
-			char *middle=": ";
-			//message includes input and name of the user.
-			char *message=malloc(strlen(message1)+strlen(user_name)+strlen(middle)+1);
-			strcpy(message,user_name);
-			strcat(message,middle);
-			strcat(message,message1);
-			char *slash="/";
-			DIR *dir;
-			struct dirent *ent;
-			if ((dir = opendir (cr_path)) != NULL) {
-				while ((ent = readdir (dir)) != NULL) {
-					//if the path includes .. or . pass
-					if(strcmp(ent->d_name,".")==0 || strcmp(ent->d_name,"..")==0) continue;
-					//pass the named pipe of user itself
-					if(strcmp(ent->d_name,user_name)==0) continue;
-
-					char *pipe = malloc(strlen(cr_path)+strlen(ent->d_name)+strlen(slash)+1);
-					strcpy(pipe,cr_path);
-					strcat(pipe,slash);
-					strcat(pipe,ent->d_name);
-					//it opens the other user' named pipes and writes on them
-					int fd;
-					fd = open(pipe, O_RDWR|O_NONBLOCK);
-					write(fd, message, strlen(message));
-					close(fd);
-				}
-			} 		
-			else {
-				perror ("");
-				return EXIT_FAILURE;
+	}
+	bool filtered=len<=HISTORY_BLOCK;
+	unsigned int pairs[64];
+	int pair_count=0;
+	for (size_t i=0;filtered && i+1<len && pair_count<64;++i)
+		pairs[pair_count++]=q[i]<<8|q[i+1];
+	const char *found=NULL;
+	if (len==1)
+		found=memrchr(history.text, query[0], end);
+	size_t groups=(history.text_size+HISTORY_GROUP-1)/HISTORY_GROUP;
+	size_t last=(end-1)/HISTORY_BLOCK; // block of the last byte searched
+	for (size_t group=last/64;len>1 && !found;--group)
+	{
+		//the other triples of a match starting in block b are in b or b+1,
+		//the bit of block b+1 is shifted down onto b, across groups as well
+		uint64_t maybe=last/64==group && last%64<63?(2ull<<(last%64))-1:~0ull;
+		//a group without the pairs of the query, its first one starting in
+		//the group and the others there or in the next, is skipped whole
+		for (int j=0;j<pair_count && maybe;++j)
+		{
+			uint64_t word=history.pairs[group][pairs[j]>>6];
+			if (j>0 && group+1<groups)
+				word|=history.pairs[group+1][pairs[j]>>6];
+			if ((word>>(pairs[j]&63)&1)==0)
+				maybe=0;
+		}
+		if (filtered)
+			maybe&=history.filters[group][first[0]]&history.filters[group][first[1]];
+		for (int j=0;j<bin_count && maybe;++j)
+		{
+			uint64_t bits=history.filters[group][bins[j]];
+			uint64_t next=group+1<groups?history.filters[group+1][bins[j]]&1:0;
+			maybe&=bits|bits>>1|next<<63;
+		}
+		while (maybe && !found) // newest run of blocks first
+		{
+			//blocks a to b, one memmem for a run skips ahead faster
+			int b=63-__builtin_clzll(maybe);
+			uint64_t below=~maybe&((1ull<<b)-1);
+			int a=below?64-__builtin_clzll(below):0;
+			maybe&=(1ull<<a)-1;
+			//matches starting in the run, the last one wins
+			const char *p=history.text+(group*64+a)*HISTORY_BLOCK, *match;
+			const char *stop=history.text+(group*64+b+1)*HISTORY_BLOCK;
+			if (stop>history.text+end-len+1)
+				stop=history.text+end-len+1;
+			while (p<stop && (match=memmem(p, stop+len-1-p, query, len))!=NULL)
+			{
+				found=match;
+				p=match+1;
 			}
-			closedir (dir);
 		}
-		
+		if (group==0)
+			break;
 	}
-}
+	if (found==NULL)
+		return -1;
 
-///Pipe helper
-int pipe_execute(struct command_t *command){
-	//Rearrange the arguments to keep the command name in the first index
-	command->args = (char**) realloc(command->args,sizeof(char*)*(command->arg_count += 2));
-	for(int i = command->arg_count - 2 ; i > 0; --i){
-		command -> args[i] = command -> args[i-1];
+	size_t offset=found-history.text;
+	size_t lo=0, hi=before; // last entry starting at or before offset
+	while (hi-lo>1)
+	{
+		size_t mid=(lo+hi)/2;
+		if (history.offsets[mid]<=offset)
+			lo=mid;
+		else
+			hi=mid;
 	}
-	command -> args[0] = strdup(command -> name);
+	return lo;
+}
 
-	//Create a pipe
-    int fd[2];
-	if (pipe(fd) == -1) {
-		fprintf(stderr,"Pipe failed");
-		return EXIT;
-	}
-	
-	//Fork a new child for the first command
-    pid_t left = fork();
-    if(left == 0){
-        close(1); //Close the standart output
-        close(fd[0]); //Close the read and of the pipe
-        dup2(fd[1],1); //Connect the standart output to write end of the pipe
-		close(fd[1]); //Close write end
-
-        //global variable PATH is read and program has gotten all the paths
-		char* PATH = getenv("PATH");											
-		char *unit_path;
-		const char s[2] = ":";
-		char *d = "/";
-		//tokenize path by dividing ":" assigned to s variable.
-		//unit_path is the first token 
-		unit_path = strtok(PATH, s);
-		//it tries all the tokens, unit_path, until it executes successfully.
-		while( unit_path != NULL ) {
-			char* pathw_cmd = malloc(strlen(unit_path)+strlen(d)+strlen(command->name)+1); 	//memory allocation for char array concat process
-			strcpy(pathw_cmd, unit_path); 											//first part is copied to pathw_cmd
-			strcat(pathw_cmd, d);													//"/" is concatenated
-			strcat(pathw_cmd, command->name); 										//command name is concatenated to pathw_cmd
-			if(execv(pathw_cmd,command->args)!= -1){									//if path input in execv includes that command it executes and exits.
-				exit(0);
-			}										
-			free(pathw_cmd);														//memory allocation freed
-			unit_path = strtok(NULL, s);											//if execv does not work, it tries next path
-		}
-		exit(0);
-    }
+///Chatroom
+/*
+	Messages travel as frames: a 32 bit length and then "user: text", without
+	the newline. A frame is at most PIPE_BUF bytes, so it is written to a
+	FIFO with a single atomic write and frames of different senders never
+	interleave.
+*/
+#define CHAT_FRAME_MAX PIPE_BUF
+#define CHAT_READ_BUF (1<<16)
 
-	//Create a second child for the second command
-	pid_t right = fork();
-	if(right == 0){
-        close(0);
-        close(fd[1]);
-        dup2(fd[0],0);
-		close(fd[0]);
-		process_command(command -> next);
-		exit(0);
-    }
+/**
+ * Build the frame of a message
+ * @param  frame CHAT_FRAME_MAX bytes
+ * @param  user  name of the sender
+ * @param  text  the message, a trailing newline is dropped
+ * @return       length of the frame, long messages are cut
+ */
+size_t chat_frame(char *frame, const char *user, const char *text)
+{
+	size_t room=CHAT_FRAME_MAX-sizeof(uint32_t);
+	int n=snprintf(frame+sizeof(uint32_t), room, "%s: %s", user, text);
+	uint32_t len=n<0?0:(size_t)n>=room?room-1:(size_t)n;
+	if (len>0 && frame[sizeof(uint32_t)+len-1]=='\n')
+		len--;
+	memcpy(frame, &len, sizeof(len));
+	return sizeof(len)+len;
+}
 
-    close( fd[0] );
-    close( fd[1] );
-    waitpid(left,NULL,NULL);
-	waitpid(right,NULL,NULL);
-    return SUCCESS;
-}
-
-int uniq_func(int flag){
-	//Buffer for keeping only one word
-	char buffer[60];
-	//A keeper array to keep all words 
-	char* keeper[100];
-	// A unique array to keep unique elements
-	char* unique_keeper[100];
-	int total_words = 0;
-	//Read from the standart input
-    while(fgets(buffer, 60 , stdin) != NULL)
-    {
-		char* tmp = malloc(strlen(buffer));
-		strcpy(tmp,buffer);
-		//Write into the keeper array
-		keeper[total_words] = tmp;
-		total_words++;
-    }
+/**
+ * Print the frames arriving on fd until it fails
+ * One buffer is reused for every read; a read may end in the middle of a
+ * frame, the rest of it is kept for the next one.
+ * @param fd        FIFO or socket to read from
+ * @param room_name printed in front of every message
+ */
+void chat_receive_frames(int fd, const char *room_name)
+{
+	char *buf=malloc(CHAT_READ_BUF);
+	size_t have=0;
+	struct pollfd pfd={ .fd=fd, .events=POLLIN };
+	while (1)
+	{
+		if (poll(&pfd, 1, -1)==-1)
+		{
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+		ssize_t n=read(fd, buf+have, CHAT_READ_BUF-have);
+		if (n==-1 && (errno==EINTR || errno==EAGAIN))
+			continue;
+		if (n<=0)
+			break;
+		have+=n;
 
-	keeper[total_words] = NULL;
-	//Update the unique array
-	int j = 0;
-	int k = 0;
-	while(keeper[j] != NULL){
-		int isElementPresent = 0; 
-    	for (int i = 0; i < k; i++) {
-			//printf("%s---%s\n",unique_keeper[i],keeper[j]);
-			//printf("result of comparison %d\n",strcmp(unique_keeper[i],keeper[j]));
-			if (strcmp(unique_keeper[i],keeper[j])==0) {
-				isElementPresent = 1;
+		size_t off=0;
+		uint32_t len;
+		while (have-off>=sizeof(len))
+		{
+			memcpy(&len, buf+off, sizeof(len));
+			if (len>CHAT_FRAME_MAX-sizeof(len)) // lost sync, drop what we have
+			{
+				off=have;
 				break;
 			}
-    	}
-		if(isElementPresent == 0){
-			unique_keeper[k] = keeper[j];
-			//printf("element of unique j = %d k = %d %s\n",j,k, unique_keeper[k]);
-			k++;
-		}
-		j++;
-	}
-	unique_keeper[k] = NULL;
-	//Print the unique array
-	if(flag == 0){
-		int l = 0;
-		while(unique_keeper[l] != NULL){
-			printf("%s",unique_keeper[l]);
-			l++;
-		} 
-	}
-
-	if(flag == 1){
-		int i = 0;
-		while(unique_keeper[i] != NULL){
-			int j = 0;
-			int counter = 0;
-			while(keeper[j] != NULL){
-				if(strcmp(unique_keeper[i],keeper[j]) == 0){
-					counter ++;
-				}
-				j++;
-			}
-			printf("%d %s",counter,unique_keeper[i]);
-			i++;
+			if (have-off-sizeof(len)<len)
+				break;
+			printf("[%s] %.*s\n", room_name, (int)len, buf+off+sizeof(len));
+			off+=sizeof(len)+len;
 		}
+		fflush(stdout);
+		memmove(buf, buf+off, have-off);
+		have-=off;
 	}
-	return SUCCESS;
-
+	free(buf);
 }
-void vigenere_func(char *_mode, char *input_mes, char *_key){
-	char msg[MAX_BUF];
-    char key[MAX_BUF];
-	strcpy(msg,input_mes);
-	strcpy(key,_key);
-	int msg_len = strlen(input_mes);
-	int key_len = strlen(_key);
-	if(msg_len<key_len){
-		printf("%s\n","key length can not be longer that message length.");
-		exit(0);
-	}
-	msg[msg_len]='\0';
-	key[key_len]='\0';
-	//printf("key:%s, plaintext:%s\n",key,msg);
 
-	char pure_msg[MAX_BUF];
-	int k;
-	int l=0;
-	for(k=0;k<msg_len;k++){
-		if(isalpha(msg[k])){
-			pure_msg[l]=msg[k];
-			l++;
-		}
-	}
-	pure_msg[l]='\0';
-	msg_len = strlen(pure_msg);
+/*
+	The sender keeps the members of the room in memory with an open write
+	descriptor each, so a message costs one write per member. The list is
+	read once when joining and then kept up to date with inotify on the room
+	directory: new FIFOs are added, removed ones dropped, and a FIFO whose
+	reader was not there yet is opened again when its reader opens it.
+	Members whose reader went away are dropped on EPIPE.
+*/
+struct chat_peer {
+	char *name;
+	int fd; // -1 while nobody reads the FIFO
+};
 
-	char longVersionOfKey[msg_len];
-	int i;
-	int j;
-	for(i = 0; i < msg_len; i++){
-        longVersionOfKey[i] = key[i%key_len];
-    }
-	longVersionOfKey[msg_len]='\0';
-	//printf("%s\n",longVersionOfKey);
+struct chat_peers {
+	const char *dir;
+	const char *self;
+	struct chat_peer *list;
+	int count;
+	int capacity;
+};
 
-	if(strcmp(_mode,"enc")==0){
-		char encOut[msg_len];
-		for(i = 0; i < msg_len; ++i){
-        	encOut[i] ='A' + ((toupper(pure_msg[i]) + toupper(longVersionOfKey[i])) % 26);
-		}
-    	encOut[msg_len] = '\0';
-		printf("Encrypted message: %s\n",encOut);
-	}
-	else if(strcmp(_mode,"dec")==0){
-		char decOut[msg_len];
-		for(i = 0; i < msg_len; ++i){
-        	decOut[i] ='A' + (((toupper(pure_msg[i]) - toupper(longVersionOfKey[i])) + 26) % 26);
-		}
-    	decOut[msg_len] = '\0';
-		printf("Decrypted message: %s\n",decOut);
+static struct chat_peer *chat_peer_find(struct chat_peers *peers, const char *name)
+{
+	for (int i=0;i<peers->count;++i)
+		if (strcmp(peers->list[i].name, name)==0)
+			return &peers->list[i];
+	return NULL;
+}
+
+static void chat_peer_open(struct chat_peers *peers, struct chat_peer *peer)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", peers->dir, peer->name);
+	peer->fd=open(path, O_WRONLY|O_NONBLOCK|O_CLOEXEC); // ENXIO while it has no reader
+}
+
+static void chat_peer_add(struct chat_peers *peers, const char *name)
+{
+	//dot files belong to the room itself, not to a member
+	if (name[0]=='.' || strcmp(name, peers->self)==0)
+		return;
+	struct chat_peer *peer=chat_peer_find(peers, name);
+	if (peer)
+	{
+		if (peer->fd==-1)
+			chat_peer_open(peers, peer);
+		return;
 	}
-	else{
-		printf("%s\n","mode can be enc or dec");
+	char path[PATH_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/%s", peers->dir, name);
+	if (stat(path, &st)==-1 || !S_ISFIFO(st.st_mode))
+		return;
+	if (peers->count==peers->capacity)
+	{
+		peers->capacity=peers->capacity?peers->capacity*2:16;
+		peers->list=realloc(peers->list, sizeof(struct chat_peer)*peers->capacity);
 	}
+	peer=&peers->list[peers->count++];
+	peer->name=strdup(name);
+	chat_peer_open(peers, peer);
 }
 
-int wiseman_function(int min){
-	FILE *fp = fopen("crontab_temp", "w");
-  	fprintf(fp, "*/%d * * * * fortune | espeak \n", min);
- 	fclose(fp);
-	struct command_t *command=malloc(sizeof(struct command_t));
-	memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-	char m_name[100];
-	strcpy(m_name,"crontab");
-	command -> name = m_name;
-	command ->arg_count = 1;
-	command -> args = malloc(sizeof(char**));
-	memset(command ->args,0,sizeof(char**));
-	char* filename = malloc(20);
-	memset(filename, 0, 20);
-	strcpy(filename,"crontab_temp");
-	command -> args[0] = filename;
-	process_command(command);
+static void chat_peer_remove(struct chat_peers *peers, const char *name)
+{
+	struct chat_peer *peer=chat_peer_find(peers, name);
+	if (peer==NULL)
+		return;
+	if (peer->fd!=-1)
+		close(peer->fd);
+	free(peer->name);
+	*peer=peers->list[--peers->count];
+}
+
+/**
+ * Apply the inotify events waiting on fd to the member list
+ */
+static void chat_peers_update(struct chat_peers *peers, int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n=read(fd, buf, sizeof(buf));
+	for (char *p=buf;n>0 && p<buf+n;)
+	{
+		struct inotify_event *ev=(struct inotify_event *)p;
+		if (ev->len>0)
+		{
+			if (ev->mask&(IN_DELETE|IN_MOVED_FROM))
+				chat_peer_remove(peers, ev->name);
+			else
+				chat_peer_add(peers, ev->name);
+		}
+		p+=sizeof(struct inotify_event)+ev->len;
+	}
+}
+
+/**
+ * Write a frame to every member, dropping the ones whose reader is gone
+ */
+static void chat_peers_send(struct chat_peers *peers, const char *frame, size_t len)
+{
+	for (int i=0;i<peers->count;++i)
+	{
+		struct chat_peer *peer=&peers->list[i];
+		if (peer->fd==-1)
+			continue;
+		if (write(peer->fd, frame, len)==-1 && errno==EPIPE)
+		{
+			close(peer->fd);
+			peer->fd=-1; // reopened if a reader opens the FIFO again
+		}
+		//EAGAIN: the member does not keep up, the message is lost for it
+	}
+}
+
+static void chat_peers_free(struct chat_peers *peers)
+{
+	while (peers->count>0)
+		chat_peer_remove(peers, peers->list[0].name);
+	free(peers->list);
+}
+
+/*
+	Every room keeps its messages in <room dir>/.history. The log is split
+	in segments of at most CHAT_SEGMENT_MAX bytes, NNNNNNNN.log, holding
+	records of a header and the frame text, and each segment has a sparse
+	index NNNNNNNN.idx with an entry for its first record and for every
+	CHAT_INDEX_EVERY-th message. The current segment and the next sequence
+	number live in the meta file, whose flock also orders the appends of
+	all the members. A joiner finds the segment and index entry of the
+	first message it wants with binary searches over the mapped index and
+	reads forward from there in the mapped segment.
+*/
+#define CHAT_SEGMENT_MAX (64<<20)
+#define CHAT_INDEX_EVERY 256
+#define CHAT_REPLAY_DEFAULT 20
+
+struct chat_record {
+	uint32_t len; // of the text after the header
+	uint32_t reserved;
+	int64_t time; // nanoseconds since the epoch
+	uint64_t seq;
+};
+
+struct chat_index {
+	uint64_t seq;
+	int64_t time;
+	uint64_t offset;
+};
+
+struct chat_meta {
+	uint64_t segment;
+	uint64_t next_seq;
+};
+
+struct chat_history {
+	int dir_fd; // .history, the files are opened relative to it
+	int meta_fd;
+	int log_fd; // open segment, reopened after a rotation
+	uint64_t log_segment;
+};
+
+#define CHAT_SEGMENT_NAME 32
+
+static void chat_segment_name(char *name, uint64_t segment, const char *ext)
+{
+	snprintf(name, CHAT_SEGMENT_NAME, "%08llu.%s", (unsigned long long)segment, ext);
+}
+
+/**
+ * Open the history of a room, creating it if needed
+ * @return 0, -1 after printing the problem
+ */
+static int chat_history_open(struct chat_history *history, const char *cr_path)
+{
+	char *path=malloc(strlen(cr_path)+sizeof("/.history"));
+	sprintf(path, "%s/.history", cr_path);
+	history->log_fd=-1;
+	history->meta_fd=-1;
+	if ((mkdir(path, 0777)==-1 && errno!=EEXIST)
+		|| (history->dir_fd=open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC))==-1
+		|| (history->meta_fd=openat(history->dir_fd, "meta", O_RDWR|O_CREAT|O_CLOEXEC, 0666))==-1)
+	{
+		printf("-%s: chatroom: %s: %s\n", sysname, path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+static void chat_history_close(struct chat_history *history)
+{
+	if (history->log_fd!=-1)
+		close(history->log_fd);
+	close(history->meta_fd);
+	close(history->dir_fd);
+}
+
+static void chat_history_meta(struct chat_history *history, struct chat_meta *meta)
+{
+	if (pread(history->meta_fd, meta, sizeof(*meta), 0)!=sizeof(*meta))
+		memset(meta, 0, sizeof(*meta));
+}
+
+/**
+ * Append a frame to the log of the room
+ * @param frame length of the text, then the text, as chat_frame() builds it
+ * @param len   bytes of the frame, the text is cut to fit in them
+ */
+static void chat_history_append(struct chat_history *history, const char *frame, size_t len)
+{
+	uint32_t text;
+	if (len<sizeof(text))
+		return;
+	memcpy(&text, frame, sizeof(text));
+	if (text>len-sizeof(text))
+		text=len-sizeof(text);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct chat_record rec={ .len=text, .time=(int64_t)now.tv_sec*1000000000+now.tv_nsec };
+	char name[CHAT_SEGMENT_NAME];
+
+	flock(history->meta_fd, LOCK_EX);
+	struct chat_meta meta;
+	chat_history_meta(history, &meta);
+	rec.seq=meta.next_seq;
+	for (int tries=0;tries<2;++tries)
+	{
+		if (history->log_fd==-1 || history->log_segment!=meta.segment)
+		{
+			if (history->log_fd!=-1)
+				close(history->log_fd);
+			chat_segment_name(name, meta.segment, "log");
+			history->log_fd=openat(history->dir_fd, name, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
+			history->log_segment=meta.segment;
+		}
+		struct stat st;
+		if (history->log_fd==-1 || fstat(history->log_fd, &st)==-1)
+			break;
+		if (st.st_size>0 && st.st_size+sizeof(rec)+text>CHAT_SEGMENT_MAX)
+		{
+			meta.segment++; // rotate
+			continue;
+		}
+		struct iovec iov[2]={ { &rec, sizeof(rec) }, { (char *)frame+sizeof(text), text } };
+		if (writev(history->log_fd, iov, 2)!=(ssize_t)(sizeof(rec)+text))
+			break;
+		if (st.st_size==0 || rec.seq%CHAT_INDEX_EVERY==0)
+		{
+			struct chat_index entry={ rec.seq, rec.time, st.st_size };
+			chat_segment_name(name, meta.segment, "idx");
+			int idx=openat(history->dir_fd, name, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
+			if (idx!=-1)
+			{
+				write(idx, &entry, sizeof(entry));
+				close(idx);
+			}
+		}
+		meta.next_seq++;
+		pwrite(history->meta_fd, &meta, sizeof(meta), 0);
+		break;
+	}
+	flock(history->meta_fd, LOCK_UN);
+}
+
+/**
+ * Map the log or index of a segment read only
+ * @return the mapping, NULL if the file is missing or empty
+ */
+static void *chat_history_map(struct chat_history *history, uint64_t segment, const char *ext, size_t *size)
+{
+	char name[CHAT_SEGMENT_NAME];
+	chat_segment_name(name, segment, ext);
+	int fd=openat(history->dir_fd, name, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	void *map=NULL;
+	if (fd!=-1 && fstat(fd, &st)==0 && st.st_size>0)
+	{
+		map=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map==MAP_FAILED)
+			map=NULL;
+		*size=st.st_size;
+	}
+	if (fd!=-1)
+		close(fd);
+	return map;
+}
+
+/**
+ * Whether the record seq, time comes before the first message to replay
+ */
+static bool chat_before(uint64_t seq, int64_t time, uint64_t from_seq, int64_t from_time)
+{
+	return from_time>=0 ? time<from_time : seq<from_seq;
+}
+
+/**
+ * Print the history of the room from a message on
+ * @param from_seq  first sequence number, used when from_time is negative
+ * @param from_time first time in nanoseconds
+ */
+static void chat_history_replay(struct chat_history *history, const char *room_name,
+	uint64_t from_seq, int64_t from_time)
+{
+	struct chat_meta meta;
+	flock(history->meta_fd, LOCK_SH);
+	chat_history_meta(history, &meta);
+	flock(history->meta_fd, LOCK_UN);
+	if (meta.next_seq==0)
+		return;
+
+	//binary search over the segments for the last one starting before the
+	//first message; missing segments count as starting before it
+	uint64_t lo=0, hi=meta.segment;
+	while (lo<hi)
+	{
+		uint64_t mid=lo+(hi-lo+1)/2;
+		size_t size;
+		struct chat_index *idx=chat_history_map(history, mid, "idx", &size);
+		bool before=idx==NULL || chat_before(idx[0].seq, idx[0].time, from_seq, from_time)
+			|| (idx[0].seq==from_seq && from_time<0);
+		if (idx)
+			munmap(idx, size);
+		if (before)
+			lo=mid;
+		else
+			hi=mid-1;
+	}
+
+	for (uint64_t segment=lo;segment<=meta.segment;++segment)
+	{
+		size_t size, idx_size;
+		char *log=chat_history_map(history, segment, "log", &size);
+		if (log==NULL)
+			continue;
+		uint64_t offset=0;
+		struct chat_index *idx=chat_history_map(history, segment, "idx", &idx_size);
+		if (idx)
+		{
+			//last index entry before the first message, scan from there
+			size_t l=0, h=idx_size/sizeof(*idx);
+			while (h-l>1)
+			{
+				size_t m=(l+h)/2;
+				if (chat_before(idx[m].seq, idx[m].time, from_seq, from_time))
+					l=m;
+				else
+					h=m;
+			}
+			offset=idx[l].offset;
+			munmap(idx, idx_size);
+		}
+		struct chat_record rec;
+		while (offset+sizeof(rec)<=size)
+		{
+			memcpy(&rec, log+offset, sizeof(rec));
+			if (offset+sizeof(rec)+rec.len>size) // cut short by a crash
+				break;
+			if (rec.seq>=meta.next_seq)
+				break;
+			if (!chat_before(rec.seq, rec.time, from_seq, from_time))
+				printf("[%s] %.*s\n", room_name, (int)rec.len, log+offset+sizeof(rec));
+			offset+=sizeof(rec)+rec.len;
+		}
+		munmap(log, size);
+	}
+	fflush(stdout);
+}
+
+/**
+ * Show what was said before joining, as asked by the options
+ */
+static void chat_history_join(struct chat_history *history, const char *room_name, struct chat_options *options)
+{
+	if (options->replay_since>=0)
+		chat_history_replay(history, room_name, 0, (int64_t)options->replay_since*1000000000);
+	else if (options->replay_count>0)
+	{
+		struct chat_meta meta;
+		chat_history_meta(history, &meta);
+		uint64_t count=options->replay_count;
+		chat_history_replay(history, room_name, meta.next_seq>count?meta.next_seq-count:0, -1);
+	}
+}
+
+/*
+	Lines typed by the user are read from stdin with read(), so the caller
+	can poll stdin together with its own descriptors, and handed to a send
+	callback as frames. A line longer than the buffer goes in pieces. Every
+	frame sent is also appended to the history of the room.
+*/
+struct chat_input {
+	char line[MAX_BUF];
+	size_t have;
+	struct chat_history *history;
+};
+
+typedef void (*chat_send_t)(void *ctx, const char *frame, size_t len);
+
+/**
+ * Read the available input and send every complete line
+ * @return 0, -1 once the input has ended
+ */
+static int chat_read_input(struct chat_input *in, const char *room_name,
+	const char *user_name, chat_send_t send, void *ctx)
+{
+	ssize_t n=read(STDIN_FILENO, in->line+in->have, sizeof(in->line)-1-in->have);
+	if (n==-1 && (errno==EINTR || errno==EAGAIN))
+		return 0;
+	if (n<=0)
+		return -1;
+	in->have+=n;
+
+	char *start=in->line, *nl;
+	while ((nl=memchr(start, '\n', in->line+in->have-start))!=NULL
+		|| (start==in->line && in->have==sizeof(in->line)-1 && (nl=in->line+in->have-1)))
+	{
+		char text[MAX_BUF];
+		size_t len=nl+1-start;
+		memcpy(text, start, len);
+		text[len]=0;
+		printf("[%s] %s: %s%s", room_name, user_name, text, *nl=='\n'?"":"\n");
+		fflush(stdout);
+		//message is a frame with the name of the user and the input.
+		char message[CHAT_FRAME_MAX];
+		size_t frame_len=chat_frame(message, user_name, text);
+		if (in->history)
+			chat_history_append(in->history, message, frame_len);
+		send(ctx, message, frame_len);
+		start=nl+1;
+	}
+	in->have=in->line+in->have-start;
+	memmove(in->line, start, in->have);
+	return 0;
+}
+
+static void chat_peers_send_cb(void *ctx, const char *frame, size_t len)
+{
+	chat_peers_send(ctx, frame, len);
+}
+
+/**
+ * Read stdin and send every line to the room until the input ends
+ * @param cr_path   room directory
+ * @param room_name printed in front of the echo of each line
+ * @param user_name sender of the lines, its own FIFO is skipped
+ */
+static void chat_send_fifo(struct chat_input *in, const char *cr_path, const char *room_name, const char *user_name)
+{
+	struct chat_peers peers={ .dir=cr_path, .self=user_name };
+	int watch=inotify_init1(IN_CLOEXEC|IN_NONBLOCK);
+	if (watch!=-1)
+		inotify_add_watch(watch, cr_path, IN_CREATE|IN_DELETE|IN_MOVED_TO|IN_MOVED_FROM|IN_OPEN);
+
+	//the directory is listed once, after the watch is in place
+	DIR *dir=opendir(cr_path);
+	struct dirent *ent;
+	while (dir && (ent=readdir(dir))!=NULL)
+		chat_peer_add(&peers, ent->d_name);
+	if (dir)
+		closedir(dir);
+
+	void (*old_sigpipe)(int)=signal(SIGPIPE, SIG_IGN);
+	struct pollfd pfd[2]={ { .fd=STDIN_FILENO, .events=POLLIN }, { .fd=watch, .events=POLLIN } };
+	while (1)
+	{
+		if (poll(pfd, watch!=-1?2:1, -1)==-1)
+		{
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+		if (watch!=-1 && (pfd[1].revents&POLLIN))
+			chat_peers_update(&peers, watch);
+		if (pfd[0].revents && chat_read_input(in, room_name, user_name, chat_peers_send_cb, &peers)==-1)
+			break; // end of input, leave the room
+	}
+
+	signal(SIGPIPE, old_sigpipe);
+	chat_peers_free(&peers);
+	if (watch!=-1)
+		close(watch);
+}
+
+/**
+ * A member of the room with a FIFO of its own, written by every other member
+ */
+static void chat_fifo_session(struct chat_input *in, const char *cr_path, char *room_name, char *user_name)
+{
+	//named pipe of the registered user is created.
+	char *namedPipe = malloc(strlen(cr_path)+strlen(user_name)+2);
+	sprintf(namedPipe, "%s/%s", cr_path, user_name);
+	mkfifo(namedPipe, 0666);
+	
+    pid_t p;
+	fflush(stdout);
+	p=fork();
+	//the child process opens the user's named pipe and sleeps in poll until
+	//messages arrive, then prints every complete frame.
+	if(p==0){
+		int fd;
+		fd = open(namedPipe, O_RDWR); // also a writer, so the FIFO never reports EOF
+		chat_receive_frames(fd, room_name);
+		close(fd);
+		exit(0);
+	}
+	//the parent process waits for the input messages of the user and sends
+	//them to every other member of the room.
+	chat_send_fifo(in, cr_path, room_name, user_name);
+	kill(p, SIGTERM);
+	waitpid(p, NULL, 0);
+	unlink(namedPipe);
+	free(namedPipe);
+}
+
+/*
+	Broker transport: the first member to join starts a broker process for
+	the room, listening on the SOCK_SEQPACKET socket <room dir>/.broker, and
+	every member connects to it. A member sends each frame once and the
+	broker fans it out. The broker works in rounds: it takes every frame
+	that arrived, then hands each client all the frames of the round that
+	are not its own with a single sendmmsg. A client whose socket is full
+	loses the rest of the round. When the last client leaves the broker
+	exits; .broker.lock keeps that from racing with a new member starting
+	a broker.
+*/
+#define BROKER_BATCH 64
+#define BROKER_EVENTS 256
+
+struct broker_client {
+	int fd;
+	bool closed;
+};
+
+static void broker_add_client(struct broker_client **clients, int *count, int *capacity, int ep, int fd)
+{
+	if (*count==*capacity)
+	{
+		*capacity=*capacity?*capacity*2:64;
+		*clients=realloc(*clients, sizeof(struct broker_client)*(*capacity));
+	}
+	(*clients)[*count].fd=fd;
+	(*clients)[*count].closed=false;
+	(*count)++;
+	struct epoll_event ev={ .events=EPOLLIN, .data.fd=fd };
+	epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void broker_close_client(struct broker_client *clients, int count, int fd)
+{
+	for (int i=0;i<count;++i)
+		if (clients[i].fd==fd && !clients[i].closed)
+		{
+			clients[i].closed=true;
+			close(fd); // also removes it from the epoll set
+		}
+}
+
+/**
+ * Main loop of the broker of a room, returns when the room is empty
+ * @param listen_fd listening socket
+ * @param sock_path path of the socket, removed on exit
+ * @param lock_path lock file taken before removing the socket
+ */
+static void chat_broker_loop(int listen_fd, const char *sock_path, const char *lock_path)
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl)==0) // thousands of members need thousands of fds
+	{
+		rl.rlim_cur=rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	int ep=epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev={ .events=EPOLLIN, .data.fd=listen_fd };
+	epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	struct broker_client *clients=NULL;
+	int count=0, capacity=0;
+	static char frames[BROKER_BATCH][CHAT_FRAME_MAX];
+	int from[BROKER_BATCH];
+	struct iovec iov[BROKER_BATCH];
+	struct mmsghdr out[BROKER_BATCH];
+	struct epoll_event events[BROKER_EVENTS];
+
+	while (1)
+	{
+		int n=epoll_wait(ep, events, BROKER_EVENTS, -1);
+		if (n==-1)
+		{
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+		int batch=0;
+		for (int i=0;i<n;++i)
+		{
+			int fd=events[i].data.fd;
+			if (fd==listen_fd)
+			{
+				int c;
+				while ((c=accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))!=-1)
+					broker_add_client(&clients, &count, &capacity, ep, c);
+				continue;
+			}
+			//take what fits in this round, epoll reports the rest again
+			while (batch<BROKER_BATCH)
+			{
+				ssize_t len=recv(fd, frames[batch], CHAT_FRAME_MAX, 0);
+				if (len>0)
+				{
+					iov[batch].iov_base=frames[batch];
+					iov[batch].iov_len=len;
+					from[batch++]=fd;
+					continue;
+				}
+				if (len==0 || (errno!=EAGAIN && errno!=EINTR))
+					broker_close_client(clients, count, fd);
+				break;
+			}
+		}
+
+		for (int c=0;c<count && batch>0;++c)
+		{
+			if (clients[c].closed)
+				continue;
+			int k=0;
+			for (int m=0;m<batch;++m)
+				if (from[m]!=clients[c].fd)
+				{
+					memset(&out[k], 0, sizeof(struct mmsghdr));
+					out[k].msg_hdr.msg_iov=&iov[m];
+					out[k].msg_hdr.msg_iovlen=1;
+					k++;
+				}
+			if (k>0 && sendmmsg(clients[c].fd, out, k, MSG_DONTWAIT|MSG_NOSIGNAL)==-1
+				&& errno!=EAGAIN && errno!=EINTR)
+				broker_close_client(clients, count, clients[c].fd);
+		}
+
+		//forget the closed clients
+		int alive=0;
+		for (int c=0;c<count;++c)
+			if (!clients[c].closed)
+				clients[alive++]=clients[c];
+		count=alive;
+
+		if (count==0)
+		{
+			//nobody left: unless someone is connecting right now, close the room
+			int lock=open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+			flock(lock, LOCK_EX);
+			int c;
+			while ((c=accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))!=-1)
+				broker_add_client(&clients, &count, &capacity, ep, c);
+			if (count==0)
+				unlink(sock_path);
+			close(lock); // releases the lock
+			if (count==0)
+				break;
+		}
+	}
+	free(clients);
+	close(ep);
+}
+
+/**
+ * Connect to the broker of a room, starting it if there is none
+ * @return connected socket, -1 on failure
+ */
+static int chat_broker_connect(const char *cr_path)
+{
+	struct sockaddr_un addr={ .sun_family=AF_UNIX };
+	char lock_path[PATH_MAX];
+	if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.broker", cr_path)>=sizeof(addr.sun_path))
+	{
+		errno=ENAMETOOLONG;
+		return -1;
+	}
+	snprintf(lock_path, sizeof(lock_path), "%s/.broker.lock", cr_path);
+
+	int fd=socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd==-1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))==0)
+		return fd;
+
+	int lock=open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	flock(lock, LOCK_EX);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))==0) // someone was faster
+	{
+		close(lock);
+		return fd;
+	}
+
+	unlink(addr.sun_path); // left over by a broker that crashed
+	int listen_fd=socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (listen_fd==-1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr))==-1
+		|| listen(listen_fd, SOMAXCONN)==-1)
+	{
+		int saved=errno;
+		if (listen_fd!=-1)
+			close(listen_fd);
+		close(lock);
+		close(fd);
+		errno=saved;
+		return -1;
+	}
+
+	//the broker is detached from the shell: it outlives the member starting it
+	fflush(stdout);
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		if (fork()==0)
+		{
+			//there is no exec, so the broker would keep every fd of the shell
+			//(zygote socket, history, trace, timerfd, SIGCHLD pipe) and the
+			//lock, whose flock would outlive the member's close. Only the
+			//listening socket is kept, moved down to fd 3.
+			setsid();
+			signal(SIGCHLD, SIG_DFL);
+			int null=open("/dev/null", O_RDWR);
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			if (listen_fd!=3)
+			{
+				dup2(listen_fd, 3);
+				listen_fd=3;
+			}
+			if (close_range(4, ~0U, 0)==-1)
+				for (long i=4, max=sysconf(_SC_OPEN_MAX); i<max; i++)
+					close(i);
+			chat_broker_loop(listen_fd, addr.sun_path, lock_path);
+			_exit(0); // the shell's atexit handlers are not the broker's
+		}
+		_exit(0);
+	}
+	if (pid>0)
+		waitpid(pid, NULL, 0);
+	close(listen_fd);
+	int r=connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	close(lock);
+	if (r==-1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void chat_socket_send(void *ctx, const char *frame, size_t len)
+{
+	int *fd=ctx;
+	if (*fd!=-1 && send(*fd, frame, len, MSG_NOSIGNAL)==-1)
+	{
+		printf("-%s: chatroom: broker: %s\n", sysname, strerror(errno));
+		*fd=-1;
+	}
+}
+
+/**
+ * A member of the room connected to its broker
+ */
+static void chat_broker_session(struct chat_input *in, const char *cr_path, char *room_name, char *user_name)
+{
+	int fd=chat_broker_connect(cr_path);
+	if (fd==-1)
+	{
+		printf("-%s: chatroom: broker: %s\n", sysname, strerror(errno));
+		return;
+	}
+	fflush(stdout);
+	pid_t p=fork();
+	if (p==0)
+	{
+		chat_receive_frames(fd, room_name);
+		exit(0);
+	}
+	int out=fd;
+	while (out!=-1 && chat_read_input(in, room_name, user_name, chat_socket_send, &out)==0)
+		;
+	close(fd);
+	kill(p, SIGTERM);
+	waitpid(p, NULL, 0);
+}
+
+/*
+	Shared memory transport: /dev/shm/chatroom-<room> is a ring of slots
+	that every member maps. A sender claims the next sequence number with
+	one atomic add, so each slot has a single producer, and the slot is a
+	seqlock: its version is odd while it is written and 2*seq+2 once the
+	frame of seq is in it. Every reader keeps its own cursor and copies the
+	slot, checking afterwards that the version did not move under it; a
+	reader that fell more than a ring behind skips ahead. Readers with
+	nothing to read sleep on a futex in the header that senders bump and
+	wake, the wake call is skipped when nobody sleeps.
+*/
+#define CHAT_SHM_SLOTS 1024
+#define CHAT_SHM_MAGIC 0x63686174 // "chat"
+#define CHAT_SHM_STUCK_MS 1000 // a claimed slot not written by then is skipped
+
+struct chat_shm_slot {
+	uint64_t version;
+	pid_t pid; // sending shell, its own receiver skips the message
+	uint32_t len;
+	char frame[CHAT_FRAME_MAX];
+};
+
+struct chat_shm_ring {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t members; // changed under flock
+	uint32_t wake; // futex word, bumped on every message
+	uint32_t waiters;
+	uint64_t head; // next sequence number
+	struct chat_shm_slot slot[];
+};
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void chat_shm_send(void *ctx, const char *frame, size_t len)
+{
+	struct chat_shm_ring *ring=ctx;
+	uint64_t seq=__atomic_fetch_add(&ring->head, 1, __ATOMIC_SEQ_CST);
+	struct chat_shm_slot *slot=&ring->slot[seq%ring->slots];
+
+	__atomic_store_n(&slot->version, 2*seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->pid=getpid();
+	slot->len=len;
+	memcpy(slot->frame, frame, len);
+	__atomic_store_n(&slot->version, 2*seq+2, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&ring->wake, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST)>0)
+		futex(&ring->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/**
+ * Print the messages of the ring from the current head on, never returns
+ */
+static void chat_shm_receive(struct chat_shm_ring *ring, const char *room_name)
+{
+	uint64_t cursor=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	pid_t sender=getppid();
+	char frame[CHAT_FRAME_MAX];
+	int stuck=0;
+	while (1)
+	{
+		uint64_t head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (cursor>=head)
+		{
+			fflush(stdout);
+			uint32_t wake=__atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST);
+			__atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)<=cursor)
+				futex(&ring->wake, FUTEX_WAIT, wake, NULL);
+			__atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (head-cursor>ring->slots) // lapped, the older messages are gone
+			cursor=head-ring->slots;
+
+		struct chat_shm_slot *slot=&ring->slot[cursor%ring->slots];
+		uint64_t version=__atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+		if (version<2*cursor+2)
+		{
+			//claimed but not written yet, wait a little for its sender
+			struct timespec ts={ 0, 1000000 };
+			uint32_t wake=__atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST);
+			__atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			futex(&ring->wake, FUTEX_WAIT, wake, &ts);
+			__atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			if (++stuck>=CHAT_SHM_STUCK_MS)
+				cursor++, stuck=0;
+			continue;
+		}
+		stuck=0;
+		if (version>2*cursor+2) // already overwritten
+		{
+			cursor++;
+			continue;
+		}
+		pid_t pid=slot->pid;
+		uint32_t len=slot->len;
+		if (len>CHAT_FRAME_MAX)
+			len=CHAT_FRAME_MAX;
+		memcpy(frame, slot->frame, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->version, __ATOMIC_RELAXED)!=version)
+			continue; // overwritten while copying, the lap check skips it
+		cursor++;
+
+		uint32_t text;
+		memcpy(&text, frame, sizeof(text));
+		if (pid!=sender && text<=len-sizeof(text))
+			printf("[%s] %.*s\n", room_name, (int)text, frame+sizeof(text));
+	}
+}
+
+/**
+ * A member of the room mapping its shared memory ring
+ */
+static void chat_shm_session(struct chat_input *in, char *room_name, char *user_name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/dev/shm/chatroom-%s", room_name);
+	size_t size=sizeof(struct chat_shm_ring)+CHAT_SHM_SLOTS*sizeof(struct chat_shm_slot);
+	int fd=open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	struct stat st;
+	if (fd==-1 || flock(fd, LOCK_EX)==-1 || fstat(fd, &st)==-1
+		|| ((size_t)st.st_size<size && ftruncate(fd, size)==-1))
+	{
+		printf("-%s: chatroom: %s: %s\n", sysname, path, strerror(errno));
+		if (fd!=-1)
+			close(fd);
+		return;
+	}
+	struct chat_shm_ring *ring=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring==MAP_FAILED)
+	{
+		printf("-%s: chatroom: %s: %s\n", sysname, path, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (ring->magic!=CHAT_SHM_MAGIC) // first member, the new file is all zeros
+	{
+		ring->slots=CHAT_SHM_SLOTS;
+		ring->magic=CHAT_SHM_MAGIC;
+	}
+	ring->members++;
+	flock(fd, LOCK_UN);
+
+	fflush(stdout);
+	pid_t p=fork();
+	if (p==0)
+	{
+		chat_shm_receive(ring, room_name);
+		exit(0);
+	}
+	while (chat_read_input(in, room_name, user_name, chat_shm_send, ring)==0)
+		;
+	kill(p, SIGTERM);
+	waitpid(p, NULL, 0);
+
+	//the last member out removes the room
+	flock(fd, LOCK_EX);
+	if (--ring->members==0)
+		unlink(path);
+	flock(fd, LOCK_UN);
+	munmap(ring, size);
+	close(fd);
+}
+
+/**
+ * Parse the arguments of the chatroom builtin
+ * chatroom [-t fifo|broker|shm] [-n COUNT | -s EPOCH] ROOM USER, the
+ * default transport comes from SHELLAX_CHAT_TRANSPORT. -n replays the last
+ * COUNT messages of the room on joining, -s those since an epoch second.
+ * @return 0 on success, -1 after printing the problem
+ */
+int chat_parse_options(struct command_t *command, struct chat_options *options,
+	char **room_name, char **user_name)
+{
+	static const char *transports[] = { "fifo", "broker", "shm", NULL };
+	const char *transport=getenv("SHELLAX_CHAT_TRANSPORT");
+	int positional=0;
+	options->replay_count=CHAT_REPLAY_DEFAULT;
+	options->replay_since=-1;
+	for (int i=0;i<command->arg_count;++i)
+	{
+		if (strcmp(command->args[i], "-t")==0 && i+1<command->arg_count)
+			transport=command->args[++i];
+		else if ((strcmp(command->args[i], "-n")==0 || strcmp(command->args[i], "-s")==0)
+			&& i+1<command->arg_count)
+		{
+			char *end;
+			long value=strtol(command->args[i+1], &end, 10);
+			if (*end || value<0)
+			{
+				printf("-%s: chatroom: %s: invalid number\n", sysname, command->args[i+1]);
+				return -1;
+			}
+			if (command->args[i][1]=='n')
+				options->replay_count=value;
+			else
+				options->replay_since=value;
+			i++;
+		}
+		else if (positional==0)
+			*room_name=command->args[i], positional++;
+		else if (positional==1)
+			*user_name=command->args[i], positional++;
+		else
+			positional++;
+	}
+	if (positional!=2)
+	{
+		printf("%s\n","Wrong number of arguments!");
+		return -1;
+	}
+	options->transport=CHAT_FIFO;
+	if (transport)
+	{
+		int t;
+		for (t=0;transports[t] && strcmp(transports[t], transport)!=0;++t)
+			;
+		if (transports[t]==NULL)
+		{
+			printf("-%s: chatroom: %s: unknown transport\n", sysname, transport);
+			return -1;
+		}
+		options->transport=t;
+	}
+	return 0;
+}
+
+void chatroom_func(char *room_name, char *user_name, struct chat_options *options){
+	/*
+		this part creates chatroom-room_name folder in the /tmp/ path. 
+	*/
+	char* cr_path_template = "/tmp/chatroom-";
+    char* cr_path = malloc(strlen(cr_path_template)+strlen(room_name)+1);
+    strcpy(cr_path,cr_path_template);
+    strcat(cr_path,room_name);
+	//if the dir does not exist, it creates the dir
+	if(mkdir(cr_path, 0777)==-1 && errno!=EEXIST){
+		printf("-%s: chatroom: %s: %s\n", sysname, cr_path, strerror(errno));
+		free(cr_path);
+		return;
+	}
+    
+    printf("\nWelcome to %s!\n\n",room_name);
+	struct chat_history history;
+	struct chat_input *in=calloc(1, sizeof(struct chat_input));
+	if (chat_history_open(&history, cr_path)==0)
+	{
+		in->history=&history;
+		chat_history_join(&history, room_name, options);
+	}
+	if (options->transport==CHAT_BROKER)
+		chat_broker_session(in, cr_path, room_name, user_name);
+	else if (options->transport==CHAT_SHM)
+		chat_shm_session(in, room_name, user_name);
+	else
+		chat_fifo_session(in, cr_path, room_name, user_name);
+	if (in->history)
+		chat_history_close(&history);
+	free(in);
+	free(cr_path);
+}
+
+///Pipe helper
+/*
+	A command line is a linked list of stages. All the pipes are created up
+	front, every stage is started as a sibling in the process group of the
+	first one, and the group becomes a job of the shell. A foreground job
+	is waited for before the next prompt, a background one is reaped
+	whenever it finishes.
+*/
+static int *pipe_status; // exit status of each stage of the last pipeline
+static int pipe_status_count;
+
+static const char *builtin_names[] = {
+	"exit", "cd", "hash", "chatroom", "myuniq", "wiseman", "vigenere",
+	"reflex", "pipestatus", "launchmode", "jobs", "fg", "bg", "wait", "time", "stats", "parallel",
+	"every", "at", "sched", NULL
+};
+
+/*
+	External stages are either forked and exec'd, or started with posix_spawn,
+	which glibc implements with clone(CLONE_VM|CLONE_VFORK) and so does not
+	copy the page tables of the shell, or handed to the zygote, a helper
+	forked before the shell heap grows. The mode is picked with
+	SHELLAX_LAUNCH at startup or with the launchmode builtin.
+*/
+enum launch_modes {
+	LAUNCH_FORK = 0,
+	LAUNCH_SPAWN = 1,
+	LAUNCH_ZYGOTE = 2,
+};
+static const char *launch_mode_names[] = { "fork", "spawn", "zygote", NULL };
+static int launch_mode=LAUNCH_FORK;
+int zygote_start(void);
+
+/**
+ * Select the launch backend by name
+ * @param  name one of launch_mode_names
+ * @return      0 on success, -1 for an unknown name
+ */
+int set_launch_mode(const char *name)
+{
+	for (int i=0;launch_mode_names[i];++i)
+		if (strcmp(launch_mode_names[i], name)==0)
+		{
+			if (i==LAUNCH_ZYGOTE && zygote_start()==-1)
+				return -1;
+			launch_mode=i;
+			return 0;
+		}
+	return -1;
+}
+
+const char *get_launch_mode(void)
+{
+	return launch_mode_names[launch_mode];
+}
+
+bool is_builtin(const char *name)
+{
+	for (int i=0;builtin_names[i];++i)
+		if (strcmp(builtin_names[i], name)==0)
+			return true;
+	return false;
+}
+
+/**
+ * Hand the terminal to a process group, if the shell has one
+ * @param pgid process group to put in the foreground
+ */
+void give_terminal(pid_t pgid)
+{
+	if (pgid>0 && isatty(STDIN_FILENO))
+		tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+/**
+ * Open the <, > and >> redirections of a command onto stdin/stdout
+ * Only called in a child process, a failing open ends the child.
+ */
+void apply_redirects(struct command_t *command)
+{
+	static const int flags[3] = {
+		O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_APPEND|O_WRONLY|O_CREAT
+	};
+	for (int i=0;i<3;++i)
+	{
+		if (command->redirects[i]==NULL)
+			continue;
+		int fw=open(command->redirects[i], flags[i], S_IRUSR | S_IWUSR);
+		if (fw==-1)
+		{
+			fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			exit(1);
+		}
+		dup2(fw, i==0?0:1);
+		close(fw);
+	}
+}
+
+/**
+ * Start an external stage with posix_spawn, the redirections become file actions
+ * Arguments are the same as launch_stage; the pipe fds are close-on-exec,
+ * so they do not need file actions of their own.
+ */
+static pid_t spawn_stage(struct command_t *command, const char *path, int in_fd,
+	int out_fd, pid_t pgid)
+{
+	extern char **environ;
+	static const int flags[3] = {
+		O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_APPEND|O_WRONLY|O_CREAT
+	};
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t defaults;
+
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd!=STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd!=STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	for (int i=0;i<3;++i)
+		if (command->redirects[i])
+			posix_spawn_file_actions_addopen(&actions, i==0?0:1,
+				command->redirects[i], flags[i], S_IRUSR | S_IWUSR);
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTTOU);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setpgroup(&attr, pgid);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int r=posix_spawn(&pid, path, &actions, &attr, command->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (r!=0)
+	{
+		fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(r));
+		return -1;
+	}
+	return pid;
+}
+
+///Zygote spawn server
+/*
+	The zygote is forked once, while the shell is still small, and launches
+	commands on behalf of the shell, so every fork copies its tiny address
+	space instead of the shell's. Requests travel over a SOCK_SEQPACKET
+	socketpair, one message per launch:
+
+		struct zygote_request | path | cwd | < | > | >> | argv[0..argc-1]
+
+	each string NUL terminated, an empty redirect meaning none, with the
+	stdin/stdout fds of the stage attached as SCM_RIGHTS. The zygote clones
+	the command with CLONE_PARENT, so it is a child of the shell and can be
+	waited for like any other stage. The reply is the pid, or -errno.
+*/
+#define ZYGOTE_MSG_MAX 65536
+
+struct zygote_request {
+	int argc;
+	pid_t pgid;
+};
+
+static int zygote_fd=-1;
+static pid_t zygote_pid;
+
+static void zygote_exec(char *msg, int len, int in_fd, int out_fd)
+{
+	static const int flags[3] = {
+		O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_APPEND|O_WRONLY|O_CREAT
+	};
+	struct zygote_request *req=(struct zygote_request *)msg;
+	char *p=msg+sizeof(struct zygote_request), *end=msg+len;
+	char *fields[5];
+	for (int i=0;i<5 && p<end;++i, p+=strlen(p)+1)
+		fields[i]=p;
+	char **argv=malloc(sizeof(char *)*(req->argc+1));
+	for (int i=0;i<req->argc && p<end;++i, p+=strlen(p)+1)
+		argv[i]=p;
+	argv[req->argc]=NULL;
+
+	setpgid(0, req->pgid);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	dup2(in_fd, STDIN_FILENO);
+	dup2(out_fd, STDOUT_FILENO);
+	if (in_fd>STDOUT_FILENO)
+		close(in_fd);
+	if (out_fd>STDOUT_FILENO)
+		close(out_fd);
+	if (chdir(fields[1])==-1)
+		fprintf(stderr, "-%s: %s: %s\n", sysname, fields[1], strerror(errno));
+	for (int i=0;i<3;++i)
+	{
+		if (fields[2+i][0]==0)
+			continue;
+		int fw=open(fields[2+i], flags[i], S_IRUSR | S_IWUSR);
+		if (fw==-1)
+		{
+			fprintf(stderr, "-%s: %s: %s\n", sysname, fields[2+i], strerror(errno));
+			exit(1);
+		}
+		dup2(fw, i==0?0:1);
+		close(fw);
+	}
+	execv(fields[0], argv);
+	fprintf(stderr, "-%s: %s: %s\n", sysname, argv[0], strerror(errno));
+	exit(126);
+}
+
+/**
+ * Main loop of the zygote, serves requests until the shell goes away
+ * @param fd zygote end of the socketpair
+ */
+static void zygote_loop(int fd)
+{
+	static char msg[ZYGOTE_MSG_MAX];
+	signal(SIGINT, SIG_IGN); // the terminal signals are for the commands
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTOU, SIG_DFL);
+	while (1)
+	{
+		char control[CMSG_SPACE(sizeof(int)*2)];
+		struct iovec iov={ msg, sizeof(msg) };
+		struct msghdr hdr={ .msg_iov=&iov, .msg_iovlen=1,
+			.msg_control=control, .msg_controllen=sizeof(control) };
+		ssize_t len=recvmsg(fd, &hdr, 0);
+		if (len==-1 && errno==EINTR)
+			continue;
+		if (len<=0)
+			exit(0);
+		struct cmsghdr *cmsg=CMSG_FIRSTHDR(&hdr);
+		int fds[2]={ STDIN_FILENO, STDOUT_FILENO };
+		if (cmsg && cmsg->cmsg_type==SCM_RIGHTS)
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		//a fork whose parent is the shell, raw clone as glibc has no wrapper for it
+		pid_t reply=syscall(SYS_clone, CLONE_PARENT|SIGCHLD, NULL, NULL, NULL, NULL);
+		if (reply==0)
+			zygote_exec(msg, len, fds[0], fds[1]);
+		if (reply==-1)
+			reply=-errno;
+		for (int i=0;i<2;++i)
+			if (fds[i]>STDOUT_FILENO)
+				close(fds[i]);
+		send(fd, &reply, sizeof(reply), 0);
+	}
+}
+
+/**
+ * Fork the zygote, if it is not running yet
+ * @return 0 on success, -1 on failure
+ */
+int zygote_start(void)
+{
+	if (zygote_fd!=-1)
+		return 0;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv)==-1)
+	{
+		fprintf(stderr, "-%s: zygote: %s\n", sysname, strerror(errno));
+		return -1;
+	}
+	fflush(stdout);
+	zygote_pid=fork();
+	if (zygote_pid==-1)
+	{
+		fprintf(stderr, "-%s: zygote: %s\n", sysname, strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (zygote_pid==0)
+	{
+		close(sv[0]);
+		zygote_loop(sv[1]);
+	}
+	close(sv[1]);
+	zygote_fd=sv[0];
+	return 0;
+}
+
+/**
+ * Forget a zygote that exited or stopped answering, the stages are
+ * forked again from then on
+ */
+static void zygote_lost(void)
+{
+	if (zygote_fd==-1)
+		return;
+	close(zygote_fd);
+	zygote_fd=-1;
+	zygote_pid=0;
+	if (launch_mode==LAUNCH_ZYGOTE)
+	{
+		launch_mode=LAUNCH_FORK;
+		fprintf(stderr, "-%s: zygote: exited, launching with fork\n", sysname);
+	}
+}
+
+/**
+ * Ask the zygote to start an external stage
+ * Arguments are the same as launch_stage.
+ * @return pid of the stage, -1 if it could not be started, -2 if the
+ *         request does not fit in a message and has to be forked instead
+ */
+static pid_t zygote_stage(struct command_t *command, const char *path, int in_fd,
+	int out_fd, pid_t pgid)
+{
+	static char msg[ZYGOTE_MSG_MAX];
+	char cwd[1024];
+	if (getcwd(cwd, sizeof(cwd))==NULL)
+		return -2;
+
+	struct zygote_request *req=(struct zygote_request *)msg;
+	req->argc=command->arg_count+1;
+	req->pgid=pgid;
+	size_t len=sizeof(struct zygote_request);
+	const char *fields[5]={ path, cwd, command->redirects[0], command->redirects[1],
+		command->redirects[2] };
+	for (int i=0;i<5+req->argc;++i)
+	{
+		const char *field=i<5?fields[i]:i==5?command->name:command->args[i-6];
+		size_t l=strlen(field?field:"")+1;
+		if (len+l>sizeof(msg))
+			return -2;
+		memcpy(msg+len, field?field:"", l);
+		len+=l;
+	}
+
+	int fds[2]={ in_fd, out_fd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov={ msg, len };
+	struct msghdr hdr={ .msg_iov=&iov, .msg_iovlen=1,
+		.msg_control=control, .msg_controllen=sizeof(control) };
+	struct cmsghdr *cmsg=CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	pid_t reply;
+	if (sendmsg(zygote_fd, &hdr, 0)==-1 || recv(zygote_fd, &reply, sizeof(reply), 0)!=sizeof(reply))
+	{
+		fprintf(stderr, "-%s: zygote: %s\n", sysname, strerror(errno));
+		zygote_lost();
+		return -2;
+	}
+	if (reply<0)
+	{
+		fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(-reply));
+		return -1;
+	}
+	return reply;
+}
+
+/**
+ * Trace the start of a stage: how long the launch took on the shell's
+ * track, and the name and start of the child's own track
+ */
+static void trace_stage(struct command_t *command, const char *how, double start, pid_t pid)
+{
+	if (!tracing() || pid<=0)
+		return;
+	trace_event(how, 'X', start, trace_now()-start, 0, 0, command->name);
+	trace_event(command->name, 'M', start, 0, pid, 0, NULL);
+	trace_event(command->name, 'B', start, 0, pid, 0, NULL); // the child exists from the fork on
+}
+
+/**
+ * Wait for a forked child to exec and trace how long execv took
+ */
+static void trace_exec(int exec_pipe[2], pid_t pid, const char *path)
+{
+	double start;
+	int error=0;
+	close(exec_pipe[1]);
+	if (read(exec_pipe[0], &start, sizeof(start))==sizeof(start))
+	{
+		bool failed=read(exec_pipe[0], &error, sizeof(error))==sizeof(error);
+		trace_event(failed?"exec failed":"exec", 'X', start, trace_now()-start, pid, 0,
+			failed?strerror(error):path);
+	}
+	close(exec_pipe[0]);
+}
+
+/**
+ * Fork one stage of a pipeline
+ * @param  command  the stage, its next pointer is ignored
+ * @param  path     resolved executable, NULL for builtins and unknown commands
+ * @param  in_fd    fd to use as stdin
+ * @param  out_fd   fd to use as stdout
+ * @param  pgid     process group to join, 0 to start a new one
+ * @param  pipes    every pipe fd of the pipeline, closed in the child
+ * @param  pipe_fds number of fds in pipes
+ * @return          pid of the stage, -1 if it could not be started
+ */
+static pid_t launch_stage(struct command_t *command, const char *path, int in_fd,
+	int out_fd, pid_t pgid, int *pipes, int pipe_fds)
+{
+	double start=trace_now();
+	if (path && launch_mode==LAUNCH_SPAWN)
+	{
+		pid_t pid=spawn_stage(command, path, in_fd, out_fd, pgid);
+		trace_stage(command, "spawn", start, pid);
+		return pid;
+	}
+	if (path && launch_mode==LAUNCH_ZYGOTE)
+	{
+		pid_t pid=zygote_stage(command, path, in_fd, out_fd, pgid);
+		if (pid>0)
+			setpgid(pid, pgid?pgid:pid); // the clone is our child, same race as with fork
+		if (pid!=-2)
+		{
+			trace_stage(command, "zygote", start, pid);
+			return pid;
+		}
+	}
+
+	//with tracing, the child sends the time it calls execv and the pipe
+	//closes when the exec succeeds
+	int exec_pipe[2]={ -1, -1 };
+	if (path && tracing() && pipe2(exec_pipe, O_CLOEXEC)==-1)
+		exec_pipe[0]=exec_pipe[1]=-1;
+
+	fflush(stdout); // do not let the child flush our buffer a second time
+	start=trace_now();
+	pid_t pid=fork();
+	if (pid!=0)
+	{
+		if (pid>0)
+			setpgid(pid, pgid?pgid:pid); // also done by the child, whoever runs first
+		else
+			fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+		trace_stage(command, "fork", start, pid);
+		if (exec_pipe[0]!=-1)
+			trace_exec(exec_pipe, pid, path);
+		return pid;
+	}
+
+	setpgid(0, pgid);
+	signal(SIGTTOU, SIG_DFL);
+	if (in_fd!=STDIN_FILENO)
+		dup2(in_fd, STDIN_FILENO);
+	if (out_fd!=STDOUT_FILENO)
+		dup2(out_fd, STDOUT_FILENO);
+	for (int i=0;i<pipe_fds;++i)
+		close(pipes[i]);
+	start=trace_now();
+	apply_redirects(command);
+	if (command->redirects[0] || command->redirects[1] || command->redirects[2])
+		trace_event("redirects", 'X', start, trace_now()-start, 0, 0, NULL);
+
+	if (path)
+	{
+		start=trace_now();
+		if (exec_pipe[1]!=-1)
+			write(exec_pipe[1], &start, sizeof(start));
+		execv(path, command->argv);
+		int error=errno;
+		if (exec_pipe[1]!=-1)
+			write(exec_pipe[1], &error, sizeof(error));
+		fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(error));
+		exit(126);
+	}
+	if (is_builtin(command->name))
+	{
+		jobs_forked();
+		command->next=NULL;
+		int code=process_command(command);
+		fflush(stdout);
+		exit(code==SUCCESS?0:1);
+	}
+	fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+	exit(127);
+}
+
+///Builtin stages
+/*
+	A stream builtin in a pipeline, myuniq or the vigenere filter and
+	crack, does not need a forked copy of the shell: it runs on a thread
+	of the shell with duplicates of its pipe ends standing in for stdin
+	and stdout. The thread closes them when the builtin returns, which is
+	the EOF the next stage waits for, and wakes the job code through the
+	SIGCHLD self-pipe. Every signal is blocked on the thread, so writing
+	to a pipe nobody reads fails with EPIPE instead of killing the shell.
+	A builtin that would read the terminal is still forked, the terminal
+	belongs to the process group of the job. SHELLAX_BUILTIN_THREADS=off
+	forks every builtin stage.
+*/
+struct builtin_stage {
+	pthread_t thread;
+	struct command_t command; // own copy, a background job outlives the line
+	int in_fd;
+	int out_fd;
+	int status;
+	struct rusage usage; // of the thread
+	bool finished; // stored last, with release order
+};
+
+static bool builtin_threads=true;
+
+/**
+ * Turn threaded builtin stages on or off
+ * @param  mode on or off
+ * @return      0 on success, -1 for anything else
+ */
+int set_builtin_threads(const char *mode)
+{
+	if (strcmp(mode, "on")!=0 && strcmp(mode, "off")!=0)
+		return -1;
+	builtin_threads=mode[1]=='n';
+	return 0;
+}
+
+/**
+ * Whether a builtin only talks through stdin and stdout, and so can run on a thread
+ */
+static bool builtin_stage_streams(const struct command_t *command)
+{
+	if (strcmp(command->name, "myuniq")==0)
+		return true;
+	return strcmp(command->name, "vigenere")==0 && (command->arg_count==2 ||
+		(command->arg_count==1 && strcmp(command->args[0], "crack")==0));
+}
+
+static void builtin_stage_copy(struct command_t *copy, const struct command_t *command)
+{
+	size_t size=sizeof(char *)*(command->arg_count+2);
+	for (int i=0;i<=command->arg_count;++i)
+		size+=strlen(command->argv[i])+8;
+	for (int i=0;i<3;++i)
+		if (command->redirects[i])
+			size+=strlen(command->redirects[i])+8;
+
+	memset(copy, 0, sizeof(struct command_t));
+	copy->arena.block_size=size;
+	copy->arg_count=command->arg_count;
+	copy->argv=arena_alloc(&copy->arena, sizeof(char *)*(command->arg_count+2));
+	for (int i=0;i<=command->arg_count;++i)
+		copy->argv[i]=arena_strdup(&copy->arena, command->argv[i]);
+	copy->argv[command->arg_count+1]=NULL;
+	copy->name=copy->argv[0];
+	copy->args=copy->argv+1;
+	for (int i=0;i<3;++i)
+		if (command->redirects[i])
+			copy->redirects[i]=arena_strdup(&copy->arena, command->redirects[i]);
+}
+
+static void *builtin_stage_main(void *arg)
+{
+	static const int flags[3] = {
+		O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_APPEND|O_WRONLY|O_CREAT
+	};
+	struct builtin_stage *stage=arg;
+	struct command_t *command=&stage->command;
+	int fds[2]={ stage->in_fd, stage->out_fd };
+	double start=trace_now();
+	stage->status=0;
+	for (int i=0;i<3;++i)
+	{
+		if (command->redirects[i]==NULL)
+			continue;
+		int fd=open(command->redirects[i], flags[i]|O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd==-1)
+		{
+			fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			stage->status=1;
+			continue;
+		}
+		close(fds[i==0?0:1]);
+		fds[i==0?0:1]=fd;
+	}
+
+	FILE *out=stage->status==0?fdopen(fds[1], "w"):NULL;
+	if (out)
+	{
+		int code;
+		if (strcmp(command->name, "myuniq")==0)
+			code=myuniq_func(command, fds[0], out);
+		else if (strcmp(command->args[0], "crack")==0)
+			code=vigenere_crack_func(command->arg_count==2?command->args[1]:NULL, fds[0], out);
+		else
+			code=vigenere_stream_func(command->args[0], command->args[1], fds[0], fds[1]);
+		stage->status=code==SUCCESS?0:1;
+		fclose(out);
+	}
+	else
+		close(fds[1]);
+	close(fds[0]);
+	if (tracing())
+	{
+		char detail[32];
+		snprintf(detail, sizeof(detail), "thread, exit %d", stage->status);
+		trace_event(command->name, 'X', start, trace_now()-start, 0, syscall(SYS_gettid), detail);
+	}
+
+	getrusage(RUSAGE_THREAD, &stage->usage);
+	__atomic_store_n(&stage->finished, true, __ATOMIC_RELEASE);
+	jobs_wake();
+	return NULL;
+}
+
+/**
+ * Start a builtin stage on a thread of the shell
+ * @param  command the stage, copied
+ * @param  in_fd   fd to use as stdin, duplicated for the thread
+ * @param  out_fd  fd to use as stdout, duplicated for the thread
+ * @return         the running stage, NULL if it has to be forked
+ */
+static struct builtin_stage *builtin_stage_start(struct command_t *command, int in_fd, int out_fd)
+{
+	struct builtin_stage *stage=calloc(1, sizeof(struct builtin_stage));
+	builtin_stage_copy(&stage->command, command);
+	stage->in_fd=fcntl(in_fd, F_DUPFD_CLOEXEC, 0);
+	stage->out_fd=fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+
+	int r=EMFILE;
+	fflush(stdout); // the thread may write to the same fd
+	if (stage->in_fd!=-1 && stage->out_fd!=-1)
+	{
+		sigset_t all, saved;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &saved); // inherited by the thread
+		r=pthread_create(&stage->thread, NULL, builtin_stage_main, stage);
+		pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	}
+	if (r==0)
+		return stage;
+	if (stage->in_fd!=-1)
+		close(stage->in_fd);
+	if (stage->out_fd!=-1)
+		close(stage->out_fd);
+	arena_free(&stage->command.arena);
+	free(stage);
+	return NULL;
+}
+
+///Jobs
+/*
+	Every pipeline is a job, kept in a list ordered by id. SIGCHLD only
+	writes a byte to a self-pipe; whoever waits for something polls that
+	pipe next to its own fds, through shell_poll(), and reaps with wait4()
+	when it becomes readable, so background jobs are collected as soon as
+	they finish, even while the prompt waits for a key. Each process keeps
+	the rusage wait4 reports, the foreground wait sleeps in the same poll
+	instead of blocking in waitpid, and finished background jobs are
+	announced before the next prompt.
+*/
+struct job_proc {
+	pid_t pid;
+	int status; // exit status, 128+signal if killed
+	bool done;
+	bool stopped;
+	struct rusage usage;
+	struct builtin_stage *builtin; // a stage on a thread of the shell, its pid is 0
+};
+
+struct job {
+	int id;
+	pid_t pgid;
+	char *text; // the command line, for jobs
+	struct job_proc *procs;
+	int count;
+	bool background;
+	bool quiet; // started by the scheduler, not announced
+	struct job *next;
+};
+
+static struct job *job_list;
+static bool jobs_quiet; // set while the scheduler starts its commands
+static int sigchld_pipe[2]={ -1, -1 };
+static struct rusage jobs_usage; // summed over every process reaped
+static long jobs_reaped;
+static struct rusage job_last_usage; // of the last foreground job, for time
+static bool job_last_valid;
+
+/**
+ * Make the next shell_poll reap, also called by builtin stages that end
+ */
+void jobs_wake(void)
+{
+	char byte=0;
+	write(sigchld_pipe[1], &byte, 1); // a full pipe already holds a wake up
+}
+
+static void sigchld_handler(int sig)
+{
+	(void)sig;
+	int saved=errno;
+	jobs_wake();
+	errno=saved;
+}
+
+/**
+ * Install the SIGCHLD self-pipe, called by main and on the first job
+ */
+void jobs_init(void)
+{
+	if (sigchld_pipe[0]!=-1)
+		return;
+	if (pipe2(sigchld_pipe, O_CLOEXEC|O_NONBLOCK)==-1)
+	{
+		fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+		return;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=sigchld_handler;
+	sa.sa_flags=SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+ * Give a forked copy of the shell a self-pipe of its own, the inherited
+ * one is shared with the parent and they would steal each other's wake ups
+ */
+void jobs_forked(void)
+{
+	if (sigchld_pipe[0]!=-1)
+	{
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		sigchld_pipe[0]=sigchld_pipe[1]=-1;
+	}
+	jobs_init();
+	sched_forked();
+}
+
+int shell_status; // exit status of the last foreground job, for scripts
+
+static struct job_proc *job_find_proc(pid_t pid, struct job **owner)
+{
+	for (struct job *job=job_list;job;job=job->next)
+		for (int i=0;i<job->count;++i)
+			if (job->procs[i].pid==pid)
+			{
+				*owner=job;
+				return &job->procs[i];
+			}
+	return NULL;
+}
+
+/**
+ * Add the usage of a process to a total, max RSS is the largest one
+ */
+static void add_usage(struct rusage *total, const struct rusage *ru)
+{
+	timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+	if (ru->ru_maxrss>total->ru_maxrss)
+		total->ru_maxrss=ru->ru_maxrss;
+	total->ru_minflt+=ru->ru_minflt;
+	total->ru_majflt+=ru->ru_majflt;
+	total->ru_nvcsw+=ru->ru_nvcsw;
+	total->ru_nivcsw+=ru->ru_nivcsw;
+}
+
+/**
+ * Collect every child that changed state, without blocking
+ */
+static void jobs_reap(void)
+{
+	char drain[256];
+	while (read(sigchld_pipe[0], drain, sizeof(drain))>0)
+		;
+	int status;
+	struct rusage usage;
+	pid_t pid;
+	while ((pid=wait4(-1, &status, WNOHANG|WUNTRACED|WCONTINUED, &usage))>0)
+	{
+		if (pid==zygote_pid && !WIFSTOPPED(status) && !WIFCONTINUED(status))
+		{
+			zygote_lost(); // it is our child too, nothing else would notice
+			continue;
+		}
+		struct job *job;
+		struct job_proc *proc=job_find_proc(pid, &job);
+		if (proc==NULL)
+			continue; // not a stage, a helper of some builtin
+		if (WIFSTOPPED(status))
+			proc->stopped=true;
+		else if (WIFCONTINUED(status))
+			proc->stopped=false;
+		else
+		{
+			proc->done=true;
+			proc->stopped=false;
+			proc->status=WIFSIGNALED(status)?128+WTERMSIG(status):WEXITSTATUS(status);
+			if (tracing())
+			{
+				char detail[32];
+				snprintf(detail, sizeof(detail), "exit %d", proc->status);
+				trace_event("stage", 'E', trace_now(), 0, pid, 0, detail);
+			}
+			proc->usage=usage;
+			add_usage(&jobs_usage, &usage);
+			jobs_reaped++;
+		}
+	}
+
+	for (struct job *job=job_list;job;job=job->next)
+		for (int i=0;i<job->count;++i)
+		{
+			struct job_proc *proc=&job->procs[i];
+			struct builtin_stage *stage=proc->builtin;
+			if (stage==NULL || !__atomic_load_n(&stage->finished, __ATOMIC_ACQUIRE))
+				continue;
+			pthread_join(stage->thread, NULL);
+			proc->done=true;
+			proc->status=stage->status;
+			proc->usage=stage->usage;
+			add_usage(&jobs_usage, &stage->usage);
+			jobs_reaped++;
+			proc->builtin=NULL;
+			arena_free(&stage->command.arena);
+			free(stage);
+		}
+}
+
+/**
+ * Wait until fd is readable, reaping children whenever SIGCHLD arrives
+ * and starting the scheduled commands that become due
+ * @param  fd      descriptor to wait for, -1 to only wait for children
+ * @param  timeout in milliseconds, -1 for none
+ * @return         1 if fd is readable, 0 otherwise
+ */
+int shell_poll(int fd, int timeout)
+{
+	jobs_init();
+	struct pollfd pfd[3]={ { .fd=sigchld_pipe[0], .events=POLLIN }, { .fd=fd, .events=POLLIN },
+		{ .fd=sched_fd(), .events=POLLIN } };
+	int n=poll(pfd, 3, timeout); // negative fds are skipped
+	if (n>0 && pfd[0].revents)
+		jobs_reap();
+	if (n>0 && pfd[2].revents)
+		sched_fire();
+	return n>0 && fd>=0 && pfd[1].revents!=0;
+}
+
+static int job_running(const struct job *job)
+{
+	int running=0, threads=0;
+	bool stopped=false;
+	for (int i=0;i<job->count;++i)
+	{
+		const struct job_proc *proc=&job->procs[i];
+		if (proc->done)
+			continue;
+		if (proc->stopped)
+			stopped=true;
+		else if (proc->builtin)
+			threads++;
+		else
+			running++;
+	}
+	return running+(stopped?0:threads); // a thread waits on the stopped processes
+}
+
+static bool job_done(const struct job *job)
+{
+	for (int i=0;i<job->count;++i)
+		if (!job->procs[i].done)
+			return false;
+	return true;
+}
+
+/**
+ * Command line of a pipeline, as shown by jobs
+ */
+static char *job_text(struct command_t *command)
+{
+	size_t len=1;
+	for (struct command_t *c=command;c;c=c->next)
+	{
+		len+=strlen(c->name)+4;
+		for (int i=0;i<c->arg_count;++i)
+			len+=strlen(c->args[i])+1;
+	}
+	char *text=malloc(len), *p=text;
+	for (struct command_t *c=command;c;c=c->next)
+	{
+		p+=sprintf(p, "%s", c->name);
+		for (int i=0;i<c->arg_count;++i)
+			p+=sprintf(p, " %s", c->args[i]);
+		if (c->next)
+			p+=sprintf(p, " | ");
+	}
+	return text;
+}
+
+/**
+ * Add a started pipeline to the job list
+ * @param pids     pid of each stage, -1 for those that failed to start
+ * @param builtins stage running on a thread for each pid of 0
+ */
+struct job *job_add(struct command_t *command, pid_t pgid, pid_t *pids,
+	struct builtin_stage **builtins, int count, bool background)
+{
+	jobs_init();
+	struct job *job=calloc(1, sizeof(struct job));
+	job->pgid=pgid;
+	job->text=job_text(command);
+	job->count=count;
+	job->background=background;
+	job->quiet=jobs_quiet;
+	job->procs=calloc(count, sizeof(struct job_proc));
+	for (int i=0;i<count;++i)
+	{
+		job->procs[i].pid=pids[i];
+		job->procs[i].builtin=builtins[i];
+		if (pids[i]<=0 && builtins[i]==NULL)
+		{
+			job->procs[i].done=true;
+			job->procs[i].status=127;
+		}
+	}
+	struct job **tail=&job_list;
+	job->id=1;
+	for (;*tail;tail=&(*tail)->next)
+		job->id=(*tail)->id+1;
+	*tail=job;
+	return job;
+}
+
+static void job_remove(struct job *job)
+{
+	for (struct job **p=&job_list;*p;p=&(*p)->next)
+		if (*p==job)
+		{
+			*p=job->next;
+			break;
+		}
+	free(job->procs);
+	free(job->text);
+	free(job);
+}
+
+static void print_usage(const struct rusage *ru)
+{
+	printf("user %ld.%03lds  sys %ld.%03lds  maxrss %ldKB  ctxsw %ld/%ld\n",
+		(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec/1000,
+		(long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec/1000,
+		ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+static void job_print(const struct job *job, bool verbose)
+{
+	const char *state=job_done(job)?"Done":job_running(job)?"Running":"Stopped";
+	printf("[%d]%c  %-9s %s%s\n", job->id, job->next?' ':'+', state, job->text,
+		job->background && !job_done(job)?" &":"");
+	if (!verbose)
+		return;
+	for (int i=0;i<job->count;++i)
+	{
+		const struct job_proc *proc=&job->procs[i];
+		if (!proc->done)
+		{
+			if (proc->builtin)
+				printf("      thread running\n");
+			else
+				printf("      %d  %s\n", proc->pid, proc->stopped?"stopped":"running");
+			continue;
+		}
+		if (proc->pid>0)
+			printf("      %d  exit %d  ", proc->pid, proc->status);
+		else
+			printf("      thread exit %d  ", proc->status);
+		print_usage(&proc->usage);
+	}
+}
+
+/**
+ * Wait for a job in the foreground, until it finishes or stops
+ * The job gets the terminal meanwhile; a finished job leaves its exit
+ * statuses in pipestatus and the job list.
+ */
+void job_wait(struct job *job)
+{
+	job->background=false;
+	give_terminal(job->pgid);
+	while (job_running(job)>0)
+		shell_poll(-1, -1);
+	give_terminal(getpgrp());
+
+	if (!job_done(job))
+	{
+		job->background=true;
+		printf("\n");
+		job_print(job, false);
+		return;
+	}
+	pipe_status=realloc(pipe_status, sizeof(int)*job->count);
+	pipe_status_count=job->count;
+	memset(&job_last_usage, 0, sizeof(job_last_usage));
+	for (int i=0;i<job->count;++i)
+	{
+		pipe_status[i]=job->procs[i].status;
+		if (job->procs[i].pid>0) // threads are in the shell's own usage
+			add_usage(&job_last_usage, &job->procs[i].usage);
+	}
+	shell_status=pipe_status[job->count-1];
+	job_last_valid=true;
+	job_remove(job);
+}
+
+/**
+ * Announce the background jobs that finished and forget them
+ */
+void jobs_notify(void)
+{
+	if (sigchld_pipe[0]!=-1)
+		jobs_reap();
+	struct job *job=job_list;
+	while (job)
+	{
+		struct job *next=job->next;
+		if (job_done(job))
+		{
+			if (!job->quiet && interactive)
+				job_print(job, false);
+			job_remove(job);
+		}
+		job=next;
+	}
+	fflush(stdout);
+}
+
+/**
+ * Find the job named by %N, a pid, or the current job for NULL
+ */
+static struct job *job_lookup(const char *spec)
+{
+	struct job *last=NULL;
+	for (struct job *job=job_list;job;job=job->next)
+	{
+		if (spec==NULL)
+			last=job;
+		else if (spec[0]=='%' && atoi(spec+1)==job->id)
+			return job;
+		else if (spec[0]!='%')
+			for (int i=0;i<job->count;++i)
+				if (job->procs[i].pid>0 && job->procs[i].pid==atoi(spec))
+					return job;
+	}
+	return last;
+}
+
+/**
+ * jobs [-v]: list the jobs, -v adds the processes and their resource usage
+ * and the total of every process reaped so far
+ */
+int jobs_func(struct command_t *command)
+{
+	bool verbose=command->arg_count>0 && strcmp(command->args[0], "-v")==0;
+	if (sigchld_pipe[0]!=-1)
+		jobs_reap();
+	struct job *job=job_list;
+	while (job)
+	{
+		struct job *next=job->next;
+		job_print(job, verbose);
+		if (job_done(job))
+			job_remove(job);
+		job=next;
+	}
+	if (verbose)
+	{
+		printf("%ld reaped  ", jobs_reaped);
+		print_usage(&jobs_usage);
+	}
+	return SUCCESS;
+}
+
+/**
+ * fg [%N] and bg [%N]: continue a job in the foreground or in the background
+ */
+int fg_func(struct command_t *command, bool foreground)
+{
+	const char *spec=command->arg_count>0?command->args[0]:NULL;
+	struct job *job=job_lookup(spec);
+	if (job==NULL)
+	{
+		printf("-%s: %s: %s: no such job\n", sysname, command->name, spec?spec:"current");
+		return SUCCESS;
+	}
+	printf("%s\n", job->text);
+	for (int i=0;i<job->count;++i)
+		job->procs[i].stopped=false;
+	if (foreground)
+		give_terminal(job->pgid); // before it runs, or it stops again on reading
+	if (job->pgid>0)
+		kill(-job->pgid, SIGCONT);
+	if (foreground)
+		job_wait(job);
+	else
+		job->background=true;
+	return SUCCESS;
+}
+
+/**
+ * wait [%N|pid ...]: wait for the given jobs, or for every running job
+ */
+int wait_func(struct command_t *command)
+{
+	while (1)
+	{
+		bool waiting=false;
+		if (command->arg_count==0)
+		{
+			for (struct job *job=job_list;job;job=job->next)
+				waiting|=job_running(job)>0;
+		}
+		else
+			for (int i=0;i<command->arg_count;++i)
+			{
+				struct job *job=job_lookup(command->args[i]);
+				waiting|=job && job_running(job)>0;
+			}
+		if (!waiting)
+			break;
+		shell_poll(-1, -1);
+	}
+	return SUCCESS;
+}
+
+///Parallel
+/*
+	parallel [-j N] [-g] CMD [ARG...] [::: VALUE...] runs CMD once per
+	value, or once per line of stdin without :::, with at most N of them
+	at a time. Every {} in the words of CMD becomes the value, which is
+	appended when there is none. The runs are started with launch_stage,
+	the same fork, spawn or zygote path as any other stage, and each one
+	is a job of its own process group; the loop sleeps in shell_poll and
+	starts the next run whenever SIGCHLD reaps one. With -g the output of
+	a run goes to a memfd and is copied out whole when it finishes, so
+	the outputs of parallel runs do not interleave. Ctrl+C stops starting
+	new runs and passes SIGINT on to the running ones.
+*/
+struct parallel_run {
+	struct job *job;
+	int out_fd; // memfd holding the output with -g, -1 otherwise
+};
+
+static volatile sig_atomic_t parallel_interrupted;
+
+static void parallel_sigint(int sig)
+{
+	(void)sig;
+	parallel_interrupted=1;
+	jobs_wake();
+}
+
+/**
+ * Build CMD for one value, {} replaced or the value appended
+ */
+static void parallel_command(struct command_t *run, char **cmd, int count, const char *value)
+{
+	size_t value_len=strlen(value), size=sizeof(char *)*(count+2)+value_len+8;
+	bool placed=false;
+	for (int i=0;i<count;++i)
+		size+=strlen(cmd[i])+8;
+	for (int i=0;i<count;++i)
+		for (const char *p=cmd[i];(p=strstr(p, "{}"));p+=2)
+			size+=value_len;
+
+	memset(run, 0, sizeof(struct command_t));
+	run->arena.block_size=size;
+	run->argv=arena_alloc(&run->arena, sizeof(char *)*(count+2));
+	for (int i=0;i<count;++i)
+	{
+		size_t len=strlen(cmd[i]);
+		for (const char *p=cmd[i];(p=strstr(p, "{}"));p+=2)
+			len+=value_len-2;
+		char *word=arena_alloc(&run->arena, len+1), *out=word;
+		for (const char *p=cmd[i];*p;)
+		{
+			if (p[0]=='{' && p[1]=='}')
+			{
+				memcpy(out, value, value_len);
+				out+=value_len;
+				p+=2;
+				placed=true;
+			}
+			else
+				*out++=*p++;
+		}
+		*out=0;
+		run->argv[run->arg_count++]=word;
+	}
+	if (!placed)
+		run->argv[run->arg_count++]=arena_strdup(&run->arena, value);
+	run->argv[run->arg_count]=NULL;
+	run->arg_count--; // the name is not an argument
+	run->name=run->argv[0];
+	run->args=run->argv+1;
+}
+
+/**
+ * Copy the output of a finished run to stdout
+ */
+static void parallel_output(int fd)
+{
+	char buf[1<<16];
+	ssize_t n;
+	lseek(fd, 0, SEEK_SET);
+	while ((n=read(fd, buf, sizeof(buf)))>0)
+		for (ssize_t done=0, w;done<n;done+=w)
+			if ((w=write(STDOUT_FILENO, buf+done, n-done))<=0)
+				return;
+}
+
+/**
+ * Next value: from the ::: list, or the next complete line of input
+ * @return the value, NULL if none is ready
+ */
+static char *parallel_next(char ***values, int *value_count, char *input, size_t *have, bool eof)
+{
+	if (values)
+	{
+		if (*value_count==0)
+			return NULL;
+		(*value_count)--;
+		return *(*values)++;
+	}
+	char *nl=memchr(input, '\n', *have);
+	if (nl==NULL && (!eof || *have==0))
+		return NULL;
+	size_t len=nl?(size_t)(nl-input):*have;
+	char *line=strndup(input, len);
+	*have-=nl?len+1:len;
+	memmove(input, input+(nl?len+1:len), *have);
+	return line;
+}
+
+int parallel_func(struct command_t *command)
+{
+	long cores=sysconf(_SC_NPROCESSORS_ONLN);
+	int jobs=cores>0?cores:1;
+	bool group=false;
+	int i=0;
+	for (;i<command->arg_count && command->args[i][0]=='-';++i)
+	{
+		if (strcmp(command->args[i], "-g")==0)
+			group=true;
+		else if (strncmp(command->args[i], "-j", 2)==0 && (command->args[i][2] || i+1<command->arg_count))
+		{
+			jobs=atoi(command->args[i][2]?command->args[i]+2:command->args[++i]);
+			if (jobs<=0) // one per core
+				jobs=cores>0?cores:1;
+		}
+		else
+		{
+			printf("-%s: %s: usage: parallel [-j N] [-g] CMD [ARG...] [::: VALUE...]\n", sysname, command->name);
+			return SUCCESS;
+		}
+	}
+	char **cmd=command->args+i, **values=NULL;
+	int cmd_count=0, value_count=0;
+	while (i+cmd_count<command->arg_count && strcmp(cmd[cmd_count], ":::")!=0)
+		cmd_count++;
+	if (i+cmd_count<command->arg_count)
+	{
+		values=cmd+cmd_count+1;
+		value_count=command->arg_count-i-cmd_count-1;
+	}
+	if (cmd_count==0)
+	{
+		printf("-%s: %s: no command\n", sysname, command->name);
+		return SUCCESS;
+	}
+
+	jobs_init();
+	char *path=is_builtin(cmd[0])?NULL:path_cache_lookup(cmd[0]);
+	int null_fd=open("/dev/null", O_RDONLY|O_CLOEXEC); // the runs do not share our input
+	struct parallel_run *runs=calloc(jobs, sizeof(struct parallel_run));
+	int running=0, failed=0;
+	size_t input_size=1<<16, have=0;
+	char *input=values?NULL:malloc(input_size);
+	bool eof=values!=NULL;
+
+	struct sigaction sa, old_sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=parallel_sigint;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_sa);
+	parallel_interrupted=0;
+
+	while (1)
+	{
+		//collect the runs that finished
+		for (int r=0;r<jobs;++r)
+		{
+			struct job *job=runs[r].job;
+			if (job==NULL || !job_done(job))
+				continue;
+			failed+=job->procs[0].status!=0;
+			if (runs[r].out_fd!=-1)
+			{
+				parallel_output(runs[r].out_fd);
+				close(runs[r].out_fd);
+			}
+			job_remove(job);
+			runs[r].job=NULL;
+			running--;
+		}
+
+		//and fill the free slots
+		char *value=NULL;
+		while (!parallel_interrupted && running<jobs
+			&& (value=parallel_next(values?&values:NULL, &value_count, input, &have, eof)))
+		{
+			int r=0;
+			while (runs[r].job)
+				r++;
+			struct command_t run;
+			parallel_command(&run, cmd, cmd_count, value);
+			if (!values)
+				free(value);
+			runs[r].out_fd=group?memfd_create("parallel", MFD_CLOEXEC):-1;
+			fflush(stdout);
+			pid_t pid=launch_stage(&run, path, null_fd, runs[r].out_fd!=-1?runs[r].out_fd:STDOUT_FILENO, 0, NULL, 0);
+			struct builtin_stage *none=NULL;
+			runs[r].job=job_add(&run, pid, &pid, &none, 1, true);
+			arena_free(&run.arena);
+			running++;
+		}
+
+		bool more=!parallel_interrupted && (values?value_count>0:!eof || have>0);
+		if (running==0 && !more)
+			break;
+		if (running<jobs && !eof && !parallel_interrupted)
+		{
+			if (shell_poll(STDIN_FILENO, -1))
+			{
+				if (have==input_size)
+					input=realloc(input, input_size*=2);
+				ssize_t n=read(STDIN_FILENO, input+have, input_size-have);
+				if (n>0)
+					have+=n;
+				else if (n==0 || errno!=EINTR)
+					eof=true;
+			}
+		}
+		else
+			shell_poll(-1, -1);
+
+		if (parallel_interrupted==1)
+		{
+			for (int r=0;r<jobs;++r)
+				if (runs[r].job && runs[r].job->pgid>0)
+					kill(-runs[r].job->pgid, SIGINT);
+			parallel_interrupted=2; // passed on once
+		}
+	}
+
+	sigaction(SIGINT, &old_sa, NULL);
+	if (null_fd!=-1)
+		close(null_fd);
+	free(runs);
+	free(input);
+	free(path);
+	shell_status=parallel_interrupted?130:failed>101?101:failed;
+	return SUCCESS;
+}
+
+///Scheduler
+/*
+	every DURATION CMD and at +DURATION|HH:MM[:SS] CMD run a command line
+	later, as a quiet background job. Every entry waits in one min-heap
+	ordered by its due time on CLOCK_MONOTONIC, and a single timerfd is
+	armed for the top of the heap with an absolute time, so it fires with
+	the kernel's timer precision instead of cron's minute. shell_poll
+	watches the timerfd next to the SIGCHLD pipe: whenever the shell waits,
+	at the prompt or for a job, due entries are started and a periodic one
+	goes back into the heap at its next multiple of the period, so a busy
+	shell skips missed runs instead of bursting. The command is kept as
+	text, with the words quoted again, and parsed anew on every run.
+*/
+struct sched_entry {
+	int id;
+	int64_t due; // CLOCK_MONOTONIC nanoseconds
+	int64_t period; // 0 for a single run
+	char *line;
+};
+
+static struct sched_entry **sched_heap;
+static int sched_count, sched_capacity;
+static int sched_timer=-1;
+static int sched_next_id=1;
+static bool sched_firing; // a scheduled builtin may wait in shell_poll itself
+
+static int64_t sched_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static void sched_swap(int a, int b)
+{
+	struct sched_entry *t=sched_heap[a];
+	sched_heap[a]=sched_heap[b];
+	sched_heap[b]=t;
+}
+
+static void sched_sift_up(int i)
+{
+	while (i>0 && sched_heap[(i-1)/2]->due>sched_heap[i]->due)
+	{
+		sched_swap(i, (i-1)/2);
+		i=(i-1)/2;
+	}
+}
+
+static void sched_sift_down(int i)
+{
+	while (1)
+	{
+		int least=i, l=2*i+1, r=2*i+2;
+		if (l<sched_count && sched_heap[l]->due<sched_heap[least]->due)
+			least=l;
+		if (r<sched_count && sched_heap[r]->due<sched_heap[least]->due)
+			least=r;
+		if (least==i)
+			return;
+		sched_swap(i, least);
+		i=least;
+	}
+}
+
+/**
+ * Take entry i out of the heap
+ */
+static struct sched_entry *sched_remove(int i)
+{
+	struct sched_entry *e=sched_heap[i];
+	sched_heap[i]=sched_heap[--sched_count];
+	if (i<sched_count)
+	{
+		sched_sift_down(i);
+		sched_sift_up(i);
+	}
+	return e;
+}
+
+/**
+ * Arm the timerfd for the top of the heap, or disarm it
+ */
+static void sched_arm(void)
+{
+	if (sched_timer==-1)
+		return;
+	struct itimerspec when;
+	memset(&when, 0, sizeof(when));
+	if (sched_count>0)
+	{
+		int64_t due=sched_heap[0]->due;
+		if (due<=0)
+			due=1; // zero would disarm it
+		when.it_value.tv_sec=due/1000000000;
+		when.it_value.tv_nsec=due%1000000000;
+	}
+	timerfd_settime(sched_timer, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/**
+ * Schedule a command line
+ * @param  line   command line, copied
+ * @param  delay  nanoseconds until the first run
+ * @param  period nanoseconds between runs, 0 to run once
+ * @return        id of the entry, -1 on error
+ */
+int sched_add(const char *line, int64_t delay, int64_t period)
+{
+	if (sched_timer==-1)
+	{
+		sched_timer=timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+		if (sched_timer==-1)
+		{
+			printf("-%s: timerfd: %s\n", sysname, strerror(errno));
+			return -1;
+		}
+	}
+	if (sched_count==sched_capacity)
+	{
+		sched_capacity=sched_capacity?sched_capacity*2:16;
+		sched_heap=realloc(sched_heap, sizeof(struct sched_entry *)*sched_capacity);
+	}
+	struct sched_entry *e=malloc(sizeof(struct sched_entry));
+	e->id=sched_next_id++;
+	e->due=sched_now()+delay;
+	e->period=period;
+	e->line=strdup(line);
+	sched_heap[sched_count++]=e;
+	sched_sift_up(sched_count-1);
+	sched_arm();
+	return e->id;
+}
+
+/**
+ * The timerfd for shell_poll, -1 while nothing is scheduled
+ */
+int sched_fd(void)
+{
+	return sched_count>0 && !sched_firing?sched_timer:-1;
+}
+
+/**
+ * Start every entry that is due, called when the timerfd fires
+ */
+void sched_fire(void)
+{
+	uint64_t expirations;
+	read(sched_timer, &expirations, sizeof(expirations));
+	sched_firing=true;
+	int64_t now=sched_now();
+	while (sched_count>0 && sched_heap[0]->due<=now)
+	{
+		struct sched_entry *e=sched_heap[0];
+		if (e->period>0)
+		{
+			e->due+=e->period*((now-e->due)/e->period+1);
+			sched_sift_down(0);
+		}
+		else
+			sched_remove(0);
+
+		//the command has its own copy of the line, and may cancel e itself
+		struct command_t *command=calloc(1, sizeof(struct command_t));
+		int parsed=parse_command(e->line, command);
+		if (e->period==0)
+		{
+			free(e->line);
+			free(e);
+		}
+		if (parsed==0)
+		{
+			for (struct command_t *c=command;c;c=c->next)
+				c->background=true;
+			jobs_quiet=true;
+			process_command(command);
+			jobs_quiet=false;
+		}
+		free_command(command);
+	}
+	fflush(stdout);
+	sched_firing=false;
+	sched_arm();
+}
+
+/**
+ * Drop the schedule in a forked copy of the shell, only the shell runs it
+ */
+void sched_forked(void)
+{
+	while (sched_count>0)
+	{
+		struct sched_entry *e=sched_remove(sched_count-1);
+		free(e->line);
+		free(e);
+	}
+	if (sched_timer!=-1)
+		close(sched_timer);
+	sched_timer=-1;
+}
+
+/**
+ * Parse a duration like 500ms, 30s, 5m, 2h or 1d, seconds without a unit
+ * @return nanoseconds, -1 if it is not one
+ */
+static int64_t sched_duration(const char *text)
+{
+	static const struct { const char *unit; double ns; } units[]={
+		{ "", 1e9 }, { "s", 1e9 }, { "ms", 1e6 }, { "m", 60e9 }, { "h", 3600e9 }, { "d", 86400e9 },
+	};
+	char *end;
+	double value=strtod(text, &end);
+	if (end==text || value<0)
+		return -1;
+	for (size_t i=0;i<sizeof(units)/sizeof(units[0]);++i)
+		if (strcmp(end, units[i].unit)==0)
+			return value*units[i].ns;
+	return -1;
+}
+
+/**
+ * Nanoseconds until the next HH:MM[:SS] of the wall clock
+ * @return the delay, -1 if text is not a time of day
+ */
+static int64_t sched_time_of_day(const char *text)
+{
+	int h, m, s=0, used=0;
+	if (sscanf(text, "%d:%d%n:%d%n", &h, &m, &used, &s, &used)<2 || text[used])
+		return -1;
+	if (h<0 || h>23 || m<0 || m>59 || s<0 || s>59)
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct tm tm;
+	localtime_r(&now.tv_sec, &tm);
+	tm.tm_hour=h;
+	tm.tm_min=m;
+	tm.tm_sec=s;
+	time_t at=mktime(&tm);
+	if (at<=now.tv_sec)
+	{
+		tm.tm_mday++; // tomorrow, mktime normalizes it
+		at=mktime(&tm);
+	}
+	return (at-now.tv_sec)*1000000000LL-now.tv_nsec;
+}
+
+/**
+ * Append a word to a line, in single quotes when the lexer would split or change it
+ * @param raw true for an operator, appended as it is
+ */
+static void sched_quote(char **line, size_t *len, size_t *size, const char *word, bool raw)
+{
+	size_t need=*len+4*strlen(word)+8;
+	if (need>*size)
+	{
+		*size=need*2;
+		*line=realloc(*line, *size);
+	}
+	char *p=*line+*len;
+	if (*len>0)
+		*p++=' ';
+	if (raw || (word[0] && strpbrk(word, " \t'\"\\|&<>")==NULL))
+		p+=sprintf(p, "%s", word);
+	else
+	{
+		*p++='\'';
+		for (;*word;++word)
+			if (*word=='\'')
+				p+=sprintf(p, "'\\''");
+			else
+				*p++=*word;
+		*p++='\'';
+	}
+	*p=0;
+	*len=p-*line;
+}
+
+/**
+ * Turn a parsed command back into a line, without the first skip words
+ * @return malloc'd line, NULL if no command is left
+ */
+static char *sched_line(struct command_t *command, int skip)
+{
+	static const char *redirect_ops[3]={ "<", ">", ">>" };
+	if (command->arg_count+1<=skip)
+		return NULL;
+	size_t len=0, size=256;
+	char *line=malloc(size);
+	line[0]=0;
+	for (struct command_t *c=command;c;c=c->next)
+	{
+		if (c!=command)
+			sched_quote(&line, &len, &size, "|", true);
+		for (int i=c==command?skip:0;i<=c->arg_count;++i)
+			sched_quote(&line, &len, &size, c->argv[i], false);
+		for (int i=0;i<3;++i)
+			if (c->redirects[i])
+			{
+				sched_quote(&line, &len, &size, redirect_ops[i], true);
+				sched_quote(&line, &len, &size, c->redirects[i], false);
+			}
+	}
+	return line;
+}
+
+/**
+ * every DURATION CMD and at +DURATION|HH:MM[:SS] CMD
+ */
+int every_func(struct command_t *command)
+{
+	bool once=strcmp(command->name, "at")==0;
+	const char *when=command->arg_count>0?command->args[0]:"";
+	int64_t delay=once && when[0]=='+'?sched_duration(when+1):once?sched_time_of_day(when):sched_duration(when);
+	char *line=sched_line(command, 2);
+	if ((once?delay<0:delay<=0) || line==NULL)
+	{
+		printf("-%s: %s: usage: %s\n", sysname, command->name,
+			once?"at +DURATION|HH:MM[:SS] CMD":"every DURATION CMD, like every 30s CMD");
+		free(line);
+		return SUCCESS;
+	}
+	int id=sched_add(line, delay, once?0:delay);
+	if (id>0 && interactive)
+		printf("[sched %d] %s %s %s\n", id, command->name, when, line);
+	free(line);
+	return SUCCESS;
+}
+
+static int sched_compare(const void *a, const void *b)
+{
+	const struct sched_entry *x=*(struct sched_entry * const *)a, *y=*(struct sched_entry * const *)b;
+	return x->due<y->due?-1:x->due>y->due;
+}
+
+/**
+ * sched list and sched cancel ID...
+ */
+int sched_func(struct command_t *command)
+{
+	if (command->arg_count==0 || strcmp(command->args[0], "list")==0)
+	{
+		struct sched_entry **sorted=malloc(sizeof(struct sched_entry *)*(sched_count+1));
+		memcpy(sorted, sched_heap, sizeof(struct sched_entry *)*sched_count);
+		qsort(sorted, sched_count, sizeof(struct sched_entry *), sched_compare);
+		int64_t now=sched_now();
+		for (int i=0;i<sched_count;++i)
+		{
+			char every[32]="once";
+			if (sorted[i]->period>0)
+				snprintf(every, sizeof(every), "every %.3fs", sorted[i]->period/1e9);
+			printf("%4d  in %9.3fs  %-16s %s\n", sorted[i]->id, (sorted[i]->due-now)/1e9, every, sorted[i]->line);
+		}
+		free(sorted);
+		return SUCCESS;
+	}
+	if (strcmp(command->args[0], "cancel")==0 && command->arg_count>1)
+	{
+		for (int a=1;a<command->arg_count;++a)
+		{
+			int id=atoi(command->args[a]), i=0;
+			while (i<sched_count && sched_heap[i]->id!=id)
+				i++;
+			if (i==sched_count)
+			{
+				printf("-%s: sched: %s: no such entry\n", sysname, command->args[a]);
+				continue;
+			}
+			struct sched_entry *e=sched_remove(i);
+			free(e->line);
+			free(e);
+		}
+		sched_arm();
+		return SUCCESS;
+	}
+	printf("-%s: sched: usage: sched [list] | sched cancel ID...\n", sysname);
+	return SUCCESS;
+}
+
+///Timing
+/*
+	time CMD runs the rest of the line and reports its wall time from
+	CLOCK_MONOTONIC and the usage of its processes as wait4 returned it,
+	plus what the shell itself spent when CMD is a builtin run in place.
+	With stats on, every command line is timed the same way and its wall
+	time goes into a log-linear histogram for the command: values below
+	2^STATS_SUB_BITS microseconds get a bucket each, every further power of
+	two is split into 2^STATS_SUB_BITS equal buckets, so a percentile read
+	from the histogram is within 1/8 of the real value.
+*/
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1<<STATS_SUB_BITS)
+#define STATS_BUCKETS ((64-STATS_SUB_BITS+1)*STATS_SUB)
+
+struct stats_entry {
+	char *name; // command, or the stages joined with |
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint32_t buckets[STATS_BUCKETS];
+};
+
+static struct stats_entry *stats_entries;
+static int stats_count;
+static bool stats_enabled;
+
+static int stats_bucket(uint64_t us)
+{
+	if (us<STATS_SUB)
+		return us;
+	int exp=63-__builtin_clzll(us); // >= STATS_SUB_BITS
+	int sub=(us>>(exp-STATS_SUB_BITS))&(STATS_SUB-1);
+	return (exp-STATS_SUB_BITS+1)*STATS_SUB+sub;
+}
+
+/**
+ * Upper bound in microseconds of the values in a bucket
+ */
+static uint64_t stats_bucket_limit(int bucket)
+{
+	if (bucket<STATS_SUB)
+		return bucket;
+	int exp=bucket/STATS_SUB+STATS_SUB_BITS-1;
+	uint64_t sub=bucket%STATS_SUB;
+	return ((STATS_SUB+sub+1)<<(exp-STATS_SUB_BITS))-1;
+}
+
+static double timespec_sec(const struct timespec *ts)
+{
+	return ts->tv_sec+ts->tv_nsec/1e9;
+}
+
+/**
+ * Name a command line is counted under in the stats
+ */
+static char *stats_key(struct command_t *command)
+{
+	if (strcmp(command->name, "time")==0 && command->arg_count>0)
+		return strdup(command->args[0]);
+	size_t len=1;
+	for (struct command_t *c=command;c;c=c->next)
+		len+=strlen(c->name)+1;
+	char *key=malloc(len), *p=key;
+	for (struct command_t *c=command;c;c=c->next)
+		p+=sprintf(p, "%s%s", c->name, c->next?"|":"");
+	return key;
+}
+
+static void stats_record(struct command_t *command, uint64_t us)
+{
+	char *key=stats_key(command);
+	struct stats_entry *entry=NULL;
+	for (int i=0;i<stats_count && !entry;++i)
+		if (strcmp(stats_entries[i].name, key)==0)
+			entry=&stats_entries[i];
+	if (entry==NULL)
+	{
+		stats_entries=realloc(stats_entries, sizeof(struct stats_entry)*(stats_count+1));
+		entry=&stats_entries[stats_count++];
+		memset(entry, 0, sizeof(*entry));
+		entry->name=key;
+	}
+	else
+		free(key);
+	entry->count++;
+	entry->total_us+=us;
+	if (us>entry->max_us)
+		entry->max_us=us;
+	entry->buckets[stats_bucket(us)]++;
+}
+
+static uint64_t stats_percentile(const struct stats_entry *entry, double q)
+{
+	uint64_t rank=(uint64_t)(q*entry->count), seen=0;
+	if (rank<q*entry->count || rank==0) // nearest rank, rounded up
+		rank++;
+	for (int i=0;i<STATS_BUCKETS;++i)
+		if ((seen+=entry->buckets[i])>=rank)
+			return stats_bucket_limit(i)<entry->max_us?stats_bucket_limit(i):entry->max_us;
+	return entry->max_us;
+}
+
+/**
+ * Run a command the way main does, timing it when stats are on
+ */
+int stats_process_command(struct command_t *command)
+{
+	if (!stats_enabled || strcmp(command->name, "")==0 || strcmp(command->name, "stats")==0)
+		return process_command(command);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int code=process_command(command);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats_record(command, (end.tv_sec-start.tv_sec)*1000000+(end.tv_nsec-start.tv_nsec)/1000);
+	return code;
+}
+
+int stats_set(const char *mode)
+{
+	if (strcmp(mode, "on")==0 || strcmp(mode, "1")==0)
+		stats_enabled=true;
+	else if (strcmp(mode, "off")==0 || strcmp(mode, "0")==0)
+		stats_enabled=false;
+	else
+		return -1;
+	return 0;
+}
+
+static int stats_compare(const void *a, const void *b)
+{
+	const struct stats_entry *x=a, *y=b;
+	return x->total_us<y->total_us?1:x->total_us>y->total_us?-1:0;
+}
+
+/**
+ * stats [on|off|reset]: switch the session timing, or print the
+ * histograms, the commands taking the most time in total first
+ */
+int stats_func(struct command_t *command)
+{
+	if (command->arg_count>0)
+	{
+		if (strcmp(command->args[0], "reset")==0)
+		{
+			for (int i=0;i<stats_count;++i)
+				free(stats_entries[i].name);
+			free(stats_entries);
+			stats_entries=NULL;
+			stats_count=0;
+		}
+		else if (stats_set(command->args[0])==-1)
+			printf("-%s: %s: %s: use on, off or reset\n", sysname, command->name, command->args[0]);
+		return SUCCESS;
+	}
+	if (!stats_enabled && stats_count==0)
+	{
+		printf("stats are off, turn them on with stats on\n");
+		return SUCCESS;
+	}
+	qsort(stats_entries, stats_count, sizeof(struct stats_entry), stats_compare);
+	printf("%-24s %8s %12s %10s %10s %10s %10s\n", "command", "count", "total ms", "p50 us", "p90 us", "p99 us", "max us");
+	for (int i=0;i<stats_count;++i)
+	{
+		const struct stats_entry *e=&stats_entries[i];
+		printf("%-24s %8llu %12.1f %10llu %10llu %10llu %10llu\n", e->name,
+			(unsigned long long)e->count, e->total_us/1000.0,
+			(unsigned long long)stats_percentile(e, 0.5),
+			(unsigned long long)stats_percentile(e, 0.9),
+			(unsigned long long)stats_percentile(e, 0.99),
+			(unsigned long long)e->max_us);
+	}
+	return SUCCESS;
+}
+
+/**
+ * time CMD: run the rest of the line and report where its time went
+ */
+int time_func(struct command_t *command)
+{
+	struct command_t timed=*command; // the same line without the time word
+	timed.name=command->args[0];
+	timed.args=command->args+1;
+	timed.argv=command->args;
+	timed.arg_count=command->arg_count-1;
+
+	struct rusage self_start, self_end;
+	struct timespec start, end;
+	job_last_valid=false;
+	getrusage(RUSAGE_SELF, &self_start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int code=process_command(&timed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &self_end);
+
+	//the shell's own share, for builtins that ran in place
+	struct rusage usage;
+	memset(&usage, 0, sizeof(usage));
+	timersub(&self_end.ru_utime, &self_start.ru_utime, &usage.ru_utime);
+	timersub(&self_end.ru_stime, &self_start.ru_stime, &usage.ru_stime);
+	usage.ru_minflt=self_end.ru_minflt-self_start.ru_minflt;
+	usage.ru_majflt=self_end.ru_majflt-self_start.ru_majflt;
+	usage.ru_nvcsw=self_end.ru_nvcsw-self_start.ru_nvcsw;
+	usage.ru_nivcsw=self_end.ru_nivcsw-self_start.ru_nivcsw;
+	if (job_last_valid)
+		add_usage(&usage, &job_last_usage);
+	else
+		usage.ru_maxrss=self_end.ru_maxrss;
+
+	struct timespec wall={ end.tv_sec-start.tv_sec, end.tv_nsec-start.tv_nsec };
+	if (wall.tv_nsec<0)
+		wall.tv_sec--, wall.tv_nsec+=1000000000;
+	fprintf(stderr, "real %.3fs  user %ld.%03lds  sys %ld.%03lds  maxrss %ldKB  faults %ld/%ld  ctxsw %ld/%ld\n",
+		timespec_sec(&wall),
+		(long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec/1000,
+		(long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec/1000,
+		usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw);
+	return code;
+}
+
+/**
+ * Run a command line of one or more stages connected with pipes
+ * @param  command first stage of the pipeline
+ * @return         SUCCESS, UNKNOWN if a single command is not found
+ */
+int pipe_execute(struct command_t *command){
+	int n=0;
+	for (struct command_t *c=command;c;c=c->next)
+		n++;
+
+	//Resolve every stage in the parent, builtins run on a thread or in a forked shell
+	char **paths=malloc(sizeof(char *)*n);
+	int i=0;
+	for (struct command_t *c=command;c;c=c->next, ++i)
+		paths[i]=is_builtin(c->name)?NULL:path_cache_lookup(c->name);
+	if (n==1 && paths[0]==NULL && !is_builtin(command->name))
+	{
+		printf("-%s: %s: command not found\n", sysname, command->name);
+		free(paths);
+		return UNKNOWN;
+	}
+
+	//Create all the pipes, fds[2*i] is read by stage i+1 and fds[2*i+1] written by stage i
+	double start=trace_now();
+	int *fds=malloc(sizeof(int)*2*(n>1?n-1:1));
+	for (i=0;i<n-1;++i)
+	{
+		if (pipe2(fds+2*i, O_CLOEXEC) == -1) {
+			fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+			for (int j=0;j<2*i;++j)
+				close(fds[j]);
+			free(fds);
+			for (int j=0;j<n;++j)
+				free(paths[j]);
+			free(paths);
+			return EXIT;
+		}
+	}
+
+	if (n>1)
+		trace_event("pipes", 'X', start, trace_now()-start, 0, 0, NULL);
+
+	//Pick the builtins that run on threads; they start after the forks, so
+	//no forked builtin inherits the fds of a thread
+	jobs_init();
+	struct builtin_stage **builtins=calloc(n, sizeof(struct builtin_stage *));
+	bool *threaded=calloc(n, sizeof(bool));
+	i=0;
+	for (struct command_t *c=command;c;c=c->next, ++i)
+		threaded[i]=builtin_threads && paths[i]==NULL && is_builtin(c->name) && builtin_stage_streams(c)
+			&& (i>0 || c->redirects[0] || !isatty(STDIN_FILENO));
+
+	//Start every other stage as a sibling in the process group of the first one
+	pid_t *pids=calloc(n, sizeof(pid_t));
+	pid_t pgid=0;
+	for (int pass=0;pass<2;++pass)
+	{
+		i=0;
+		for (struct command_t *c=command;c;c=c->next, ++i)
+		{
+			if (threaded[i]!=(pass==1))
+				continue;
+			int in_fd=i>0?fds[2*(i-1)]:STDIN_FILENO;
+			int out_fd=i<n-1?fds[2*i+1]:STDOUT_FILENO;
+			if (threaded[i])
+				builtins[i]=builtin_stage_start(c, in_fd, out_fd);
+			if (builtins[i]==NULL) // no thread, it is forked after all
+				pids[i]=launch_stage(c, paths[i], in_fd, out_fd, pgid, fds, 2*(n-1));
+			if (pids[i]>0 && pgid==0)
+				pgid=pids[i];
+		}
+	}
+	for (i=0;i<2*(n-1);++i)
+		close(fds[i]);
+
+	//The group becomes a job, waited for unless it runs in the background
+	bool background=false;
+	for (struct command_t *c=command;c;c=c->next)
+		background|=c->background;
+	bool started=pgid>0;
+	for (i=0;i<n;++i)
+		started|=builtins[i]!=NULL;
+	if (started)
+	{
+		struct job *job=job_add(command, pgid, pids, builtins, n, background);
+		if (background)
+		{
+			//scripts and -c strings do not announce their jobs
+			if (interactive && !job->quiet && pgid>0)
+				printf("[%d] %d\n", job->id, pgid);
+			else if (interactive && !job->quiet)
+				printf("[%d]\n", job->id);
+		}
+		else
+		{
+			start=trace_now();
+			char *text=tracing()?strdup(job->text):NULL; // a finished job is freed
+			job_wait(job);
+			trace_event("wait", 'X', start, trace_now()-start, 0, 0, text);
+			free(text);
+		}
+	}
+
+	free(builtins);
+	free(threaded);
+	free(pids);
+	free(fds);
+	for (i=0;i<n;++i)
+		free(paths[i]);
+	free(paths);
+	return SUCCESS;
+}
+
+/**
+ * Print the exit status of each stage of the last foreground pipeline
+ */
+void print_pipe_status(void)
+{
+	for (int i=0;i<pipe_status_count;++i)
+		printf("%d%c", pipe_status[i], i==pipe_status_count-1?'\n':' ');
+}
+
+///PATH resolution cache
+/*
+	Executables are resolved once in the shell process and remembered in a
+	small hash table, like the hash builtin of bash. An entry found in the
+	i-th PATH directory stays valid as long as the modification times of the
+	first i+1 directories do not change, since a new file in any of them
+	could shadow it. A changed PATH drops the whole table.
+*/
+#define PATH_CACHE_BUCKETS 256
+
+struct path_cache_entry {
+	char *name;
+	char *path;
+	int dir_index; // PATH directory the command was found in
+	int hits;
+	struct path_cache_entry *next;
+};
+
+struct path_dir {
+	char *path;
+	struct timespec mtime;
+};
+
+static struct path_cache_entry *path_cache[PATH_CACHE_BUCKETS];
+static char *path_cache_env; // the PATH value the table was built for
+static struct path_dir *path_dirs;
+static int path_dir_count;
+
+static unsigned int path_cache_hash(const char *name)
+{
+	unsigned int h=2166136261u; // FNV-1a
+	for (;*name;++name)
+		h=(h^(unsigned char)*name)*16777619u;
+	return h%PATH_CACHE_BUCKETS;
+}
+
+static struct timespec path_dir_mtime(const char *dir)
+{
+	struct stat st;
+	struct timespec none={0, 0};
+	if (stat(dir, &st)==-1)
+		return none;
+	return st.st_mtim;
+}
+
+/**
+ * Drop the cached entries resolved from PATH directory `from` or later
+ * @param from first invalid directory index
+ */
+static void path_cache_invalidate(int from)
+{
+	for (int b=0;b<PATH_CACHE_BUCKETS;++b)
+	{
+		struct path_cache_entry **link=&path_cache[b];
+		while (*link)
+		{
+			struct path_cache_entry *e=*link;
+			if (e->dir_index>=from)
+			{
+				*link=e->next;
+				free(e->name);
+				free(e->path);
+				free(e);
+			}
+			else
+				link=&e->next;
+		}
+	}
+}
+
+/**
+ * Forget every resolved command and the PATH split (hash -r)
+ */
+void path_cache_clear(void)
+{
+	path_cache_invalidate(0);
+	for (int i=0;i<path_dir_count;++i)
+		free(path_dirs[i].path);
+	free(path_dirs);
+	path_dirs=NULL;
+	path_dir_count=0;
+	free(path_cache_env);
+	path_cache_env=NULL;
+}
+
+/**
+ * Make sure the directory list matches the current PATH
+ */
+static void path_cache_sync(void)
+{
+	const char *env=getenv("PATH");
+	if (env==NULL)
+		env="/usr/local/bin:/usr/bin:/bin";
+	if (path_cache_env && strcmp(path_cache_env, env)==0)
+		return;
+
+	path_cache_clear();
+	path_cache_env=strdup(env);
+
+	//split a private copy, strtok must not touch the real environment
+	char *copy=strdup(env), *save=NULL;
+	for (char *dir=strtok_r(copy, ":", &save);dir;dir=strtok_r(NULL, ":", &save))
+	{
+		path_dirs=realloc(path_dirs, sizeof(struct path_dir)*(path_dir_count+1));
+		path_dirs[path_dir_count].path=strdup(dir);
+		path_dirs[path_dir_count].mtime=path_dir_mtime(dir);
+		path_dir_count++;
+	}
+	free(copy);
+}
+
+/**
+ * Check the first `count` PATH directories for changes since they were seen
+ * @return index of the first changed directory, -1 if none changed
+ */
+static int path_dirs_changed(int count)
+{
+	for (int i=0;i<count && i<path_dir_count;++i)
+	{
+		struct timespec now=path_dir_mtime(path_dirs[i].path);
+		if (now.tv_sec!=path_dirs[i].mtime.tv_sec || now.tv_nsec!=path_dirs[i].mtime.tv_nsec)
+		{
+			path_dirs[i].mtime=now;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool is_executable(const char *path)
+{
+	struct stat st;
+	return stat(path, &st)==0 && S_ISREG(st.st_mode) && access(path, X_OK)==0;
+}
+
+/**
+ * Resolve a command name to the executable that execv should run
+ * The result is a copy, a later lookup may drop the entry it came from.
+ * @param  name command name, used as is when it contains a slash
+ * @return      path of the executable to free, NULL if it can not be found
+ */
+char *path_cache_lookup(const char *name)
+{
+	if (strchr(name, '/'))
+		return is_executable(name)?strdup(name):NULL;
+
+	path_cache_sync();
+	unsigned int b=path_cache_hash(name);
+	struct path_cache_entry *e;
+	for (e=path_cache[b];e;e=e->next)
+		if (strcmp(e->name, name)==0)
+			break;
+	if (e)
+	{
+		int changed=path_dirs_changed(e->dir_index+1);
+		if (changed==-1)
+		{
+			e->hits++;
+			return strdup(e->path);
+		}
+		path_cache_invalidate(changed);
+	}
+
+	for (int i=0;i<path_dir_count;++i)
+	{
+		char *candidate=malloc(strlen(path_dirs[i].path)+strlen(name)+2);
+		sprintf(candidate, "%s/%s", path_dirs[i].path, name);
+		if (is_executable(candidate))
+		{
+			e=malloc(sizeof(struct path_cache_entry));
+			e->name=strdup(name);
+			e->path=candidate;
+			e->dir_index=i;
+			e->hits=1;
+			e->next=path_cache[b];
+			path_cache[b]=e;
+			return strdup(candidate);
+		}
+		free(candidate);
+	}
+	return NULL;
+}
+
+/**
+ * Print the cached commands in the format of bash's hash builtin
+ */
+void path_cache_print(void)
+{
+	int shown=0;
+	for (int b=0;b<PATH_CACHE_BUCKETS;++b)
+		for (struct path_cache_entry *e=path_cache[b];e;e=e->next)
+		{
+			if (!shown++)
+				printf("hits\tcommand\n");
+			printf("%4d\t%s\n", e->hits, e->path);
+		}
+	if (!shown)
+		printf("%s: hash table empty\n", sysname);
+}
+
+///Completion
+/*
+	Command names are completed from a prefix trie of the builtins and of
+	every executable in PATH. A helper thread builds it at startup, so the
+	first prompt does not wait for thousands of directory entries, and
+	rebuilds the part of one directory when its modification time changes:
+	each node keeps a bitmask of the PATH directories holding that exact
+	name, a rescan clears the bit of the directory everywhere and inserts
+	its names again. A change is noticed on Tab and the rescan runs while
+	the user keeps typing, that Tab still sees the old names.
+
+	Arguments are completed from directory listings read with getdents64,
+	the last few of them are cached by inode and modification time. A
+	listing taken in the second the directory last changed is not trusted,
+	since a change later in that second keeps the same time.
+*/
+#define COMPLETION_DIRS 64 // PATH directories after these are not completed
+#define COMPLETION_LIST 256 // matches kept for listing
+#define DIR_CACHE_SLOTS 8
+#define DIR_READ_SIZE (32<<10)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct trie_node {
+	uint32_t child; // first child, 0 for none since the root is no child
+	uint32_t sibling; // next child of the same parent, in key order
+	uint64_t dirs; // PATH directories holding this exact name
+	unsigned char key;
+	bool builtin;
+};
+
+struct completion_dir {
+	char *path;
+	struct timespec mtime;
+	time_t listed; // when the last rescan was asked for
+};
+
+struct dir_listing {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	time_t listed;
+	char *entries; // type byte and NUL terminated name, one after the other
+	size_t size;
+	unsigned long used; // dir_cache_clock of the last lookup
+};
+
+static pthread_mutex_t completion_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t completion_wake=PTHREAD_COND_INITIALIZER; // for the helper thread
+static pthread_cond_t completion_built=PTHREAD_COND_INITIALIZER; // for the first Tab
+static struct trie_node *trie_nodes;
+static uint32_t trie_count, trie_capacity;
+static struct completion_dir completion_dirs[COMPLETION_DIRS];
+static int completion_dir_count;
+static uint64_t completion_stale; // directories waiting for a rescan
+static bool completion_ready, completion_started;
+
+static struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+static unsigned long dir_cache_clock;
+
+/**
+ * Check a directory against the time it was listed at
+ * @param  st     stat of the directory, NULL if it is gone
+ * @param  mtime  modification time when it was listed
+ * @param  listed when it was listed
+ * @return        true if the listing is still good
+ */
+static bool listing_current(const struct stat *st, const struct timespec *mtime, time_t listed)
+{
+	struct timespec now={0, 0};
+	if (st)
+		now=st->st_mtim;
+	return now.tv_sec==mtime->tv_sec && now.tv_nsec==mtime->tv_nsec && mtime->tv_sec<listed;
+}
+
+/**
+ * Read a directory with getdents64
+ * Symlinks and entries of unknown type are resolved with fstatat, so
+ * DT_DIR in the result also covers links to directories.
+ * @param  path        directory
+ * @param  executables keep the executable files only
+ * @param  size        set to the size of the returned buffer
+ * @return             malloc'd entries, NULL if it can not be opened
+ */
+static char *dir_list(const char *path, bool executables, size_t *size)
+{
+	int fd=open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd==-1)
+		return NULL;
+	char *buf=malloc(DIR_READ_SIZE);
+	char *entries=NULL;
+	size_t used=0, capacity=0;
+	long n;
+	while ((n=syscall(SYS_getdents64, fd, buf, DIR_READ_SIZE))>0)
+	{
+		for (long off=0;off<n;)
+		{
+			struct linux_dirent64 *d=(struct linux_dirent64 *)(buf+off);
+			off+=d->d_reclen;
+			const char *name=d->d_name;
+			if (name[0]=='.' && (name[1]==0 || (name[1]=='.' && name[2]==0)))
+				continue;
+			unsigned char type=d->d_type;
+			struct stat st;
+			if (type==DT_LNK || type==DT_UNKNOWN)
+			{
+				if (fstatat(fd, name, &st, 0)==0)
+					type=S_ISDIR(st.st_mode)?DT_DIR:S_ISREG(st.st_mode)?DT_REG:type;
+				else if (executables)
+					continue; // dangling link
+			}
+			if (executables && (type!=DT_REG || faccessat(fd, name, X_OK, 0)==-1))
+				continue;
+
+			size_t len=strlen(name);
+			if (used+len+2>capacity)
+			{
+				capacity=capacity?capacity*2:4096;
+				if (capacity<used+len+2)
+					capacity=used+len+2;
+				entries=realloc(entries, capacity);
+			}
+			entries[used]=type;
+			memcpy(entries+used+1, name, len+1);
+			used+=len+2;
+		}
+	}
+	free(buf);
+	close(fd);
+	*size=used;
+	return entries?entries:malloc(1);
+}
+
+static uint32_t trie_node_new(unsigned char key)
+{
+	if (trie_count==trie_capacity)
+	{
+		trie_capacity=trie_capacity?trie_capacity*2:4096;
+		trie_nodes=realloc(trie_nodes, sizeof(struct trie_node)*trie_capacity);
+	}
+	struct trie_node *node=&trie_nodes[trie_count];
+	memset(node, 0, sizeof(struct trie_node));
+	node->key=key;
+	return trie_count++;
+}
+
+static void trie_insert(const char *name, uint64_t dirs, bool builtin)
+{
+	if (trie_count==0)
+		trie_node_new(0); // the root
+	uint32_t n=0;
+	for (const unsigned char *p=(const unsigned char *)name;*p;++p)
+	{
+		uint32_t prev=0, c=trie_nodes[n].child;
+		while (c && trie_nodes[c].key<*p)
+		{
+			prev=c;
+			c=trie_nodes[c].sibling;
+		}
+		if (c==0 || trie_nodes[c].key!=*p)
+		{
+			uint32_t fresh=trie_node_new(*p); // may move trie_nodes
+			trie_nodes[fresh].sibling=c;
+			if (prev)
+				trie_nodes[prev].sibling=fresh;
+			else
+				trie_nodes[n].child=fresh;
+			c=fresh;
+		}
+		n=c;
+	}
+	trie_nodes[n].dirs|=dirs;
+	trie_nodes[n].builtin|=builtin;
+}
+
+/**
+ * Helper thread, rescans the directories marked stale one at a time
+ * The listing is read without the lock, only the trie update holds it.
+ */
+static void *completion_worker(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&completion_lock);
+	while (1)
+	{
+		while (completion_stale==0)
+		{
+			completion_ready=true;
+			pthread_cond_broadcast(&completion_built);
+			pthread_cond_wait(&completion_wake, &completion_lock);
+		}
+		int d=__builtin_ctzll(completion_stale);
+		uint64_t bit=1ull<<d;
+		completion_stale&=~bit;
+		pthread_mutex_unlock(&completion_lock);
+
+		size_t size=0;
+		char *entries=dir_list(completion_dirs[d].path, true, &size);
+
+		pthread_mutex_lock(&completion_lock);
+		for (uint32_t i=0;i<trie_count;++i)
+			trie_nodes[i].dirs&=~bit;
+		for (size_t off=0;entries && off<size;off+=strlen(entries+off+1)+2)
+			trie_insert(entries+off+1, bit, false);
+		free(entries);
+	}
+	return NULL;
+}
+
+/**
+ * Start building the command trie in the background
+ */
+void completion_start(void)
+{
+	if (completion_started)
+		return;
+	completion_started=true;
+	const char *env=getenv("PATH");
+	if (env==NULL)
+		env="/usr/local/bin:/usr/bin:/bin";
+	char *copy=strdup(env), *save=NULL;
+	for (char *dir=strtok_r(copy, ":", &save);dir && completion_dir_count<COMPLETION_DIRS;dir=strtok_r(NULL, ":", &save))
+		completion_dirs[completion_dir_count++].path=strdup(dir);
+	free(copy);
+
+	pthread_mutex_lock(&completion_lock);
+	for (int i=0;builtin_names[i];++i)
+		trie_insert(builtin_names[i], 0, true);
+	pthread_mutex_unlock(&completion_lock);
+	completion_rescan();
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, completion_worker, NULL)==0)
+		pthread_detach(thread);
+	else
+		completion_ready=true; // the builtins are all there is
+}
+
+/**
+ * Queue the PATH directories for a rescan, every one of them or the ones
+ * that changed since their last one
+ * @param all false to check the modification times first
+ */
+static void completion_refresh(bool all)
+{
+	time_t now=time(NULL);
+	uint64_t stale=0;
+	for (int d=0;d<completion_dir_count;++d)
+	{
+		struct stat st;
+		bool found=stat(completion_dirs[d].path, &st)==0;
+		if (!all && listing_current(found?&st:NULL, &completion_dirs[d].mtime, completion_dirs[d].listed))
+			continue;
+		completion_dirs[d].mtime=found?st.st_mtim:(struct timespec){0, 0};
+		completion_dirs[d].listed=now;
+		stale|=1ull<<d;
+	}
+	if (stale)
+	{
+		completion_stale|=stale;
+		pthread_cond_signal(&completion_wake);
+	}
+}
+
+/**
+ * Rescan every PATH directory (hash -r)
+ */
+void completion_rescan(void)
+{
+	pthread_mutex_lock(&completion_lock);
+	completion_refresh(true);
+	pthread_mutex_unlock(&completion_lock);
+}
+
+/**
+ * Record a match, keeping the length of the prefix common to all of them
+ */
+static void completion_note(struct completion *result, const char *name, size_t len)
+{
+	if (result->total==0)
+		result->common=len;
+	else
+	{
+		size_t i=0;
+		while (i<result->common && result->names[0][i]==name[i])
+			i++;
+		result->common=i;
+	}
+	result->total++;
+	if (result->count==COMPLETION_LIST)
+		return;
+	if (result->count==result->capacity)
+	{
+		int grown=result->capacity?result->capacity*2:16;
+		char **names=arena_alloc(&result->arena, sizeof(char *)*grown);
+		if (result->count)
+			memcpy(names, result->names, sizeof(char *)*result->count);
+		result->names=names;
+		result->capacity=grown;
+	}
+	char *copy=arena_alloc(&result->arena, len+1);
+	memcpy(copy, name, len);
+	copy[len]=0;
+	result->names[result->count++]=copy;
+}
+
+static void trie_collect(uint32_t n, char *name, int depth, struct completion *result)
+{
+	if (trie_nodes[n].dirs || trie_nodes[n].builtin)
+		completion_note(result, name, depth);
+	if (depth>=NAME_MAX)
+		return;
+	for (uint32_t c=trie_nodes[n].child;c;c=trie_nodes[c].sibling)
+	{
+		name[depth]=trie_nodes[c].key;
+		trie_collect(c, name, depth+1, result);
+	}
+}
+
+/**
+ * Complete a command name from the trie
+ */
+static void complete_command(const char *word, struct completion *result)
+{
+	completion_start(); // not started yet for a -c string or a script
+	pthread_mutex_lock(&completion_lock);
+	completion_refresh(false);
+	while (!completion_ready)
+		pthread_cond_wait(&completion_built, &completion_lock);
+
+	uint32_t n=0;
+	for (const unsigned char *p=(const unsigned char *)word;*p && trie_count;++p)
+	{
+		uint32_t c=trie_nodes[n].child;
+		while (c && trie_nodes[c].key<*p)
+			c=trie_nodes[c].sibling;
+		if (c==0 || trie_nodes[c].key!=*p)
+		{
+			n=UINT32_MAX;
+			break;
+		}
+		n=c;
+	}
+	size_t len=strlen(word);
+	if (trie_count && n!=UINT32_MAX && len<NAME_MAX)
+	{
+		char name[NAME_MAX+1];
+		memcpy(name, word, len);
+		trie_collect(n, name, len, result);
+	}
+	pthread_mutex_unlock(&completion_lock);
+}
+
+/**
+ * Listing of a directory, from the cache when it did not change
+ * @return entries, NULL if the directory can not be read
+ */
+static struct dir_listing *dir_cache_lookup(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st)==-1 || !S_ISDIR(st.st_mode))
+		return NULL;
+	struct dir_listing *slot=&dir_cache[0];
+	for (int i=0;i<DIR_CACHE_SLOTS;++i)
+	{
+		struct dir_listing *l=&dir_cache[i];
+		if (l->entries && l->dev==st.st_dev && l->ino==st.st_ino)
+		{
+			if (listing_current(&st, &l->mtime, l->listed))
+			{
+				l->used=++dir_cache_clock;
+				return l;
+			}
+			slot=l;
+			break;
+		}
+		if (l->used<slot->used)
+			slot=l;
+	}
+
+	free(slot->entries);
+	slot->dev=st.st_dev;
+	slot->ino=st.st_ino;
+	slot->mtime=st.st_mtim;
+	slot->listed=time(NULL);
+	slot->entries=dir_list(path, false, &slot->size);
+	slot->used=++dir_cache_clock;
+	return slot->entries?slot:NULL;
+}
+
+/**
+ * Complete a file name, directories get a trailing slash
+ */
+static void complete_file(const char *word, struct completion *result)
+{
+	const char *slash=strrchr(word, '/');
+	size_t dir_len=slash?slash-word+1:0;
+	const char *base=word+dir_len;
+	size_t base_len=strlen(base);
+	char dir[PATH_MAX];
+	if (dir_len==0)
+		strcpy(dir, ".");
+	else if (dir_len<sizeof(dir))
+	{
+		memcpy(dir, word, dir_len);
+		dir[dir_len]=0;
+	}
+	else
+		return;
+	result->shown=dir_len;
+
+	struct dir_listing *l=dir_cache_lookup(dir);
+	if (l==NULL)
+		return;
+	char name[PATH_MAX+1];
+	memcpy(name, word, dir_len);
+	for (size_t off=0;off<l->size;)
+	{
+		unsigned char type=l->entries[off];
+		const char *entry=l->entries+off+1;
+		size_t len=strlen(entry);
+		off+=len+2;
+		if (strncmp(entry, base, base_len)!=0 || (entry[0]=='.' && base[0]!='.'))
+			continue;
+		if (dir_len+len+2>sizeof(name))
+			continue;
+		memcpy(name+dir_len, entry, len);
+		if (type==DT_DIR)
+			name[dir_len+len++]='/';
+		completion_note(result, name, dir_len+len);
+	}
+}
+
+static int completion_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Find the completions of a word
+ * @param word         the word before the cursor, quotes already removed
+ * @param command_word true for the first word of a stage
+ * @param result       zeroed, free its arena afterwards
+ */
+void completion_find(const char *word, bool command_word, struct completion *result)
+{
+	if (command_word && strchr(word, '/')==NULL)
+		complete_command(word, result);
+	else
+		complete_file(word, result);
+	qsort(result->names, result->count, sizeof(char *), completion_compare);
+}
+
+/**
+ * Print the matches in columns, like ls
+ */
+void completion_print(struct completion *result)
+{
+	struct winsize ws;
+	int width=80;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws)==0 && ws.ws_col>0)
+		width=ws.ws_col;
+	size_t longest=1;
+	for (int i=0;i<result->count;++i)
+		if (strlen(result->names[i]+result->shown)>longest)
+			longest=strlen(result->names[i]+result->shown);
+	int column=longest+2;
+	int columns=width/column>0?width/column:1;
+	int rows=(result->count+columns-1)/columns;
+	for (int r=0;r<rows;++r)
+	{
+		for (int c=0;c<columns;++c)
+		{
+			int i=c*rows+r;
+			if (i>=result->count)
+				break;
+			const char *name=result->names[i]+result->shown;
+			if (c==columns-1 || i+rows>=result->count)
+				printf("%s", name);
+			else
+				printf("%-*s", column, name);
+		}
+		putchar('\n');
+	}
+	if (result->total>result->count)
+		printf("(%ld more)\n", result->total-result->count);
+}
+
+/**
+ * List the completions of a line ending in ?
+ */
+int complete_func(struct command_t *command)
+{
+	struct command_t *stage=command;
+	while (stage->next)
+		stage=stage->next;
+	char *word=stage->argv?stage->argv[stage->arg_count]:NULL;
+	bool command_word=stage->arg_count==0;
+	for (int i=0;i<3;++i) // a redirection written last
+	{
+		char *target=stage->redirects[i];
+		if (target && target[0] && target[strlen(target)-1]=='?')
+		{
+			word=target;
+			command_word=false;
+		}
+	}
+	if (word==NULL)
+		return SUCCESS;
+
+	size_t len=strlen(word);
+	char prefix[PATH_MAX];
+	if (len>0 && word[len-1]=='?')
+		len--;
+	if (len>=sizeof(prefix))
+		return SUCCESS;
+	memcpy(prefix, word, len);
+	prefix[len]=0;
+
+	struct completion result;
+	memset(&result, 0, sizeof(result));
+	completion_find(prefix, command_word, &result);
+	completion_print(&result);
+	arena_free(&result.arena);
+	return SUCCESS;
+}
+
+///myuniq
+/*
+	Lines are kept in an open addressing hash table. The slots hold indexes
+	into a dense entry array, which is in first-seen order, so printing
+	the unique lines is a walk over the entries.
+*/
+struct uniq_entry {
+	const char *line; // without the newline
+	size_t len;
+	size_t count;
+	uint64_t hash;
+};
+
+struct uniq_table {
+	struct uniq_entry *entries;
+	size_t count;
+	size_t capacity;
+	uint32_t *slots; // entry index+1, 0 when empty
+	size_t mask;
+};
+
+static uint64_t uniq_hash(const char *p, size_t len)
+{
+	uint64_t h=0x9e3779b97f4a7c15ull^len, k;
+	for (;len>=8;p+=8, len-=8)
+	{
+		memcpy(&k, p, 8);
+		h=(h^(k*0xbf58476d1ce4e5b9ull))*0x94d049bb133111ebull;
+		h^=h>>31;
+	}
+	k=0;
+	memcpy(&k, p, len);
+	h^=k*0xbf58476d1ce4e5b9ull;
+	h^=h>>30; // splitmix64 finalizer
+	h*=0xbf58476d1ce4e5b9ull;
+	h^=h>>27;
+	h*=0x94d049bb133111ebull;
+	return h^(h>>31);
+}
+
+void uniq_table_init(struct uniq_table *table)
+{
+	memset(table, 0, sizeof(struct uniq_table));
+	table->mask=1023;
+	table->slots=calloc(table->mask+1, sizeof(uint32_t));
+}
+
+void uniq_table_free(struct uniq_table *table)
+{
+	free(table->entries);
+	free(table->slots);
+}
+
+static void uniq_table_grow(struct uniq_table *table)
+{
+	free(table->slots);
+	table->mask=table->mask*2+1;
+	table->slots=calloc(table->mask+1, sizeof(uint32_t));
+	for (size_t i=0;i<table->count;++i)
+	{
+		size_t slot=table->entries[i].hash&table->mask;
+		while (table->slots[slot])
+			slot=(slot+1)&table->mask;
+		table->slots[slot]=i+1;
+	}
+}
+
+/**
+ * Find a line in the table, or add it at the end of the entries
+ * A new entry points to `line` as is, the caller makes it outlive the table.
+ * @param  table  table of the unique lines seen so far
+ * @param  line   start of the line, not NUL terminated
+ * @param  len    length without the newline
+ * @param  hash   uniq_hash() of the line
+ * @param  is_new set to true if the line was not in the table
+ * @return        the entry of the line
+ */
+struct uniq_entry *uniq_table_insert(struct uniq_table *table, const char *line,
+	size_t len, uint64_t hash, bool *is_new)
+{
+	size_t slot=hash&table->mask;
+	for (;table->slots[slot];slot=(slot+1)&table->mask)
+	{
+		struct uniq_entry *e=&table->entries[table->slots[slot]-1];
+		if (e->hash==hash && e->len==len && memcmp(e->line, line, len)==0)
+		{
+			*is_new=false;
+			return e;
+		}
+	}
+	if (table->count==table->capacity)
+	{
+		table->capacity=table->capacity?table->capacity*2:1024;
+		table->entries=realloc(table->entries, sizeof(struct uniq_entry)*table->capacity);
+	}
+	struct uniq_entry *e=&table->entries[table->count++];
+	e->line=line;
+	e->len=len;
+	e->count=0;
+	e->hash=hash;
+	table->slots[slot]=table->count;
+	if (table->count*2>table->mask)
+		uniq_table_grow(table);
+	*is_new=true;
+	return e;
+}
+
+/**
+ * myuniq [-c|--count] [FILE]: print the unique lines of FILE or of in_fd
+ * @param  in_fd stands in for stdin
+ * @param  out   stands in for stdout
+ * @return       SUCCESS
+ */
+int myuniq_func(struct command_t *command, int in_fd, FILE *out)
+{
+	int flag=0;
+	char *file=NULL;
+	for (int i=0;i<command->arg_count;++i)
+	{
+		if((strcmp(command->args[i],"-c")== 0) || (strcmp(command -> args[i],"--count") == 0)){
+			flag=1;
+		}else if(command->args[i][0]!='-' && file==NULL){
+			file=command->args[i];
+		}else{
+			fprintf(stderr, "-%s: %s: %s: unknown option\n", sysname, command->name, command->args[i]);
+			return SUCCESS;
+		}
+	}
+	if(file){
+		return uniq_file_func(file, flag, out);
+	}
+	return uniq_func(flag, in_fd, out);
+}
+
+/**
+ * Print the unique lines of in_fd in first-seen order
+ * Without the count flag each line is written as soon as it is first seen,
+ * with it the counts are printed once the input ends.
+ * @param  flag 1 to prefix each line with its number of occurrences
+ * @return      SUCCESS
+ */
+int uniq_func(int flag, int in_fd, FILE *out){
+	struct uniq_table table;
+	struct arena pool={ NULL };
+	uniq_table_init(&table);
+
+	size_t capacity=1<<16, have=0;
+	char *buffer=malloc(capacity);
+	bool eof=false;
+	while (!eof)
+	{
+		if (have==capacity) // a line longer than the buffer
+		{
+			capacity*=2;
+			buffer=realloc(buffer, capacity);
+		}
+		ssize_t n=read(in_fd, buffer+have, capacity-have);
+		if (n==-1 && errno==EINTR)
+			continue;
+		if (n<=0)
+		{
+			eof=true;
+			if (have==0)
+				break;
+			buffer[have++]='\n'; // the last line has no newline
+		}
+		else
+			have+=n;
+
+		char *line=buffer, *end=buffer+have, *nl;
+		while ((nl=memchr(line, '\n', end-line))!=NULL)
+		{
+			size_t len=nl-line;
+			bool is_new;
+			struct uniq_entry *e=uniq_table_insert(&table, line, len, uniq_hash(line, len), &is_new);
+			if (is_new)
+			{
+				//the read buffer is reused, new lines move to the string pool
+				char *copy=arena_alloc(&pool, len);
+				memcpy(copy, line, len);
+				e->line=copy;
+				if (flag==0)
+				{
+					fwrite(copy, 1, len, out);
+					putc('\n', out);
+				}
+			}
+			e->count++;
+			line=nl+1;
+		}
+		have=end-line;
+		memmove(buffer, line, have);
+	}
+
+	if (flag==1)
+		for (size_t i=0;i<table.count;++i)
+		{
+			fprintf(out, "%zu ", table.entries[i].count);
+			fwrite(table.entries[i].line, 1, table.entries[i].len, out);
+			putc('\n', out);
+		}
+	fflush(out);
+
+	free(buffer);
+	uniq_table_free(&table);
+	arena_free(&pool);
+	return SUCCESS;
+}
+/*
+	A file argument is mapped and cut into one chunk per core at newline
+	boundaries. Each thread dedupes its chunk into its own table, pointing
+	into the mapping instead of copying. The tables are then merged in chunk
+	order: every line of chunk i comes before every line of chunk i+1, so
+	appending new lines to the global table keeps first-seen order, and the
+	offset of the first occurrence is kept for each line.
+*/
+#define UNIQ_MIN_CHUNK (1<<20)
+
+struct uniq_chunk {
+	const char *start;
+	const char *end;
+	struct uniq_table table;
+};
+
+static void *uniq_chunk_worker(void *arg)
+{
+	struct uniq_chunk *chunk=arg;
+	const char *line=chunk->start, *nl;
+	uniq_table_init(&chunk->table);
+	while (line<chunk->end)
+	{
+		nl=memchr(line, '\n', chunk->end-line);
+		size_t len=(nl?nl:chunk->end)-line;
+		bool is_new;
+		uniq_table_insert(&chunk->table, line, len, uniq_hash(line, len), &is_new)->count++;
+		line+=len+1;
+	}
+	return NULL;
+}
+
+/**
+ * Print the unique lines of a file in first-seen order, using all cores
+ * @param  file path of the file
+ * @param  flag 1 to prefix each line with its number of occurrences
+ * @return      SUCCESS
+ */
+int uniq_file_func(const char *file, int flag, FILE *out)
+{
+	int fd=open(file, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd==-1 || fstat(fd, &st)==-1)
+	{
+		fprintf(stderr, "-%s: myuniq: %s: %s\n", sysname, file, strerror(errno));
+		if (fd!=-1)
+			close(fd);
+		return SUCCESS;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size==0) // pipes and the like are streamed
+	{
+		uniq_func(flag, fd, out);
+		close(fd);
+		return SUCCESS;
+	}
+	const char *data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data==MAP_FAILED)
+	{
+		fprintf(stderr, "-%s: myuniq: %s: %s\n", sysname, file, strerror(errno));
+		return SUCCESS;
+	}
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+	//cut the file into chunks that end right after a newline
+	long cores=sysconf(_SC_NPROCESSORS_ONLN);
+	int count=cores>0?cores:1;
+	if (st.st_size/count<UNIQ_MIN_CHUNK)
+		count=st.st_size/UNIQ_MIN_CHUNK+1;
+	struct uniq_chunk *chunks=calloc(count, sizeof(struct uniq_chunk));
+	const char *pos=data, *end=data+st.st_size;
+	int used=0;
+	for (int i=0;i<count && pos<end;++i)
+	{
+		const char *cut=i==count-1?end:pos+(end-pos)/(count-i);
+		const char *nl=cut<end?memchr(cut, '\n', end-cut):NULL;
+		cut=nl?nl+1:end;
+		chunks[used].start=pos;
+		chunks[used].end=cut;
+		used++;
+		pos=cut;
+	}
+
+	pthread_t *threads=malloc(sizeof(pthread_t)*used);
+	bool *started=calloc(used, sizeof(bool));
+	for (int i=1;i<used;++i)
+		if (pthread_create(&threads[i], NULL, uniq_chunk_worker, &chunks[i])==0)
+			started[i]=true;
+		else
+			uniq_chunk_worker(&chunks[i]); // no thread, do the chunk here
+	uniq_chunk_worker(&chunks[0]);
+	for (int i=1;i<used;++i)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	free(started);
+
+	//merge in chunk order, the first chunk's table becomes the result
+	struct uniq_table *result=&chunks[0].table;
+	for (int i=1;i<used;++i)
+	{
+		struct uniq_table *t=&chunks[i].table;
+		for (size_t j=0;j<t->count;++j)
+		{
+			bool is_new;
+			struct uniq_entry *e=uniq_table_insert(result, t->entries[j].line,
+				t->entries[j].len, t->entries[j].hash, &is_new);
+			e->count+=t->entries[j].count;
+		}
+		uniq_table_free(t);
+	}
+
+	for (size_t i=0;i<result->count;++i)
+	{
+		//e->line-data is the offset of the first occurrence in the file
+		struct uniq_entry *e=&result->entries[i];
+		if (flag==1)
+			fprintf(out, "%zu ", e->count);
+		fwrite(e->line, 1, e->len, out);
+		putc('\n', out);
+	}
+	fflush(out);
+
+	uniq_table_free(result);
+	free(threads);
+	free(chunks);
+	munmap((void *)data, st.st_size);
+	return SUCCESS;
+}
+
+///Vigenere cipher
+/*
+	Only letters are enciphered, everything else is dropped, and the output
+	is upper case. Decryption is encryption with the key shifts negated, so a
+	single kernel serves both. The kernel loads the key shifts for the
+	current position from ext, the key repeated just enough to read a full
+	vector from any offset, and never expands the key to the message length.
+*/
+#define VIGENERE_BLOCK (1<<16)
+#define VIGENERE_VEC 32
+
+struct vigenere_key {
+	size_t len;
+	unsigned char *ext; // len+VIGENERE_VEC shifts, ext[i]=shift of letter i%len
+};
+
+/**
+ * Prepare the key shifts for a mode
+ * @param  key  filled in, release with vigenere_key_free()
+ * @param  mode enc or dec
+ * @param  text the key, non letters are ignored
+ * @return      0 on success, -1 after printing the problem
+ */
+int vigenere_key_init(struct vigenere_key *key, const char *mode, const char *text)
+{
+	int sign;
+	if (strcmp(mode, "enc")==0)
+		sign=1;
+	else if (strcmp(mode, "dec")==0)
+		sign=-1;
+	else {
+		printf("%s\n","mode can be enc or dec");
+		return -1;
+	}
+	key->len=0;
+	key->ext=malloc(strlen(text)+VIGENERE_VEC);
+	for (;*text;++text)
+		if (isalpha((unsigned char)*text))
+			key->ext[key->len++]=(26+sign*(toupper((unsigned char)*text)-'A'))%26;
+	if (key->len==0)
+	{
+		printf("%s\n","key must contain letters");
+		free(key->ext);
+		return -1;
+	}
+	for (size_t i=key->len;i<key->len+VIGENERE_VEC;++i)
+		key->ext[i]=key->ext[i%key->len];
+	return 0;
+}
+
+void vigenere_key_free(struct vigenere_key *key)
+{
+	free(key->ext);
+}
+
+static bool is_letter(unsigned char c)
+{
+	return (unsigned char)((c|0x20)-'a')<26;
+}
+
+static size_t vigenere_letters_scalar(const char *in, size_t n, char *out)
+{
+	size_t l=0;
+	for (size_t i=0;i<n;++i)
+		if (is_letter(in[i]))
+			out[l++]=in[i];
+	return l;
+}
+
+static void vigenere_apply_scalar(const struct vigenere_key *key, size_t pos,
+	const char *in, char *out, size_t n)
+{
+	size_t k=pos%key->len;
+	for (size_t i=0;i<n;++i)
+	{
+		unsigned char s=((in[i]&0xdf)-'A')+key->ext[k];
+		out[i]='A'+(s>=26?s-26:s);
+		if (++k==key->len)
+			k=0;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static size_t vigenere_letters_avx2(const char *in, size_t n, char *out)
+{
+	const __m256i lower=_mm256_set1_epi8(0x20), a=_mm256_set1_epi8('a'), z=_mm256_set1_epi8(25);
+	size_t i=0, l=0;
+	for (;i+32<=n;i+=32)
+	{
+		__m256i c=_mm256_loadu_si256((const __m256i *)(in+i));
+		__m256i t=_mm256_sub_epi8(_mm256_or_si256(c, lower), a);
+		__m256i ok=_mm256_cmpeq_epi8(_mm256_min_epu8(t, z), t);
+		if ((unsigned)_mm256_movemask_epi8(ok)==0xffffffffu) // the common all-letters block
+		{
+			_mm256_storeu_si256((__m256i *)(out+l), c);
+			l+=32;
+		}
+		else
+			l+=vigenere_letters_scalar(in+i, 32, out+l);
+	}
+	return l+vigenere_letters_scalar(in+i, n-i, out+l);
+}
+
+__attribute__((target("avx2")))
+static void vigenere_apply_avx2(const struct vigenere_key *key, size_t pos,
+	const char *in, char *out, size_t n)
+{
+	const __m256i upper=_mm256_set1_epi8((char)0xdf), A=_mm256_set1_epi8('A'), m26=_mm256_set1_epi8(26);
+	size_t k=pos%key->len, i=0;
+	for (;i+32<=n;i+=32)
+	{
+		__m256i p=_mm256_sub_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in+i)), upper), A);
+		__m256i s=_mm256_add_epi8(p, _mm256_loadu_si256((const __m256i *)(key->ext+k)));
+		s=_mm256_min_epu8(s, _mm256_sub_epi8(s, m26)); // s<26 wraps above 26 when reduced
+		_mm256_storeu_si256((__m256i *)(out+i), _mm256_add_epi8(s, A));
+		k=(k+32)%key->len;
+	}
+	vigenere_apply_scalar(key, k, in+i, out+i, n-i);
+}
+
+static size_t vigenere_letters_sse2(const char *in, size_t n, char *out)
+{
+	const __m128i lower=_mm_set1_epi8(0x20), a=_mm_set1_epi8('a'), z=_mm_set1_epi8(25);
+	size_t i=0, l=0;
+	for (;i+16<=n;i+=16)
+	{
+		__m128i c=_mm_loadu_si128((const __m128i *)(in+i));
+		__m128i t=_mm_sub_epi8(_mm_or_si128(c, lower), a);
+		__m128i ok=_mm_cmpeq_epi8(_mm_min_epu8(t, z), t);
+		if (_mm_movemask_epi8(ok)==0xffff)
+		{
+			_mm_storeu_si128((__m128i *)(out+l), c);
+			l+=16;
+		}
+		else
+			l+=vigenere_letters_scalar(in+i, 16, out+l);
+	}
+	return l+vigenere_letters_scalar(in+i, n-i, out+l);
+}
+
+static void vigenere_apply_sse2(const struct vigenere_key *key, size_t pos,
+	const char *in, char *out, size_t n)
+{
+	const __m128i upper=_mm_set1_epi8((char)0xdf), A=_mm_set1_epi8('A'), m26=_mm_set1_epi8(26);
+	size_t k=pos%key->len, i=0;
+	for (;i+16<=n;i+=16)
+	{
+		__m128i p=_mm_sub_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *)(in+i)), upper), A);
+		__m128i s=_mm_add_epi8(p, _mm_loadu_si128((const __m128i *)(key->ext+k)));
+		s=_mm_min_epu8(s, _mm_sub_epi8(s, m26));
+		_mm_storeu_si128((__m128i *)(out+i), _mm_add_epi8(s, A));
+		k=(k+16)%key->len;
+	}
+	vigenere_apply_scalar(key, k, in+i, out+i, n-i);
+}
+#endif
+
+/**
+ * Copy the letters of a buffer, dropping everything else
+ * @return number of letters written to out
+ */
+size_t vigenere_letters(const char *in, size_t n, char *out)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return vigenere_letters_avx2(in, n, out);
+	if (__builtin_cpu_supports("sse2"))
+		return vigenere_letters_sse2(in, n, out);
+#endif
+	return vigenere_letters_scalar(in, n, out);
+}
+
+/**
+ * Encipher letters with the key, in may be the same buffer as out
+ * @param pos index of in[0] in the whole letter stream, selects the key shift
+ */
+void vigenere_apply(const struct vigenere_key *key, size_t pos, const char *in,
+	char *out, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return vigenere_apply_avx2(key, pos, in, out, n);
+	if (__builtin_cpu_supports("sse2"))
+		return vigenere_apply_sse2(key, pos, in, out, n);
+#endif
+	vigenere_apply_scalar(key, pos, in, out, n);
+}
+
+void vigenere_func(char *_mode, char *input_mes, char *_key){
+	struct vigenere_key key;
+	if (vigenere_key_init(&key, _mode, _key)==-1)
+		return;
+	size_t msg_len=strlen(input_mes);
+	char *out=malloc(msg_len+1);
+	msg_len=vigenere_letters(input_mes, msg_len, out);
+	if(msg_len<key.len){
+		printf("%s\n","key length can not be longer that message length.");
+	}
+	else {
+		vigenere_apply(&key, 0, out, out, msg_len);
+		out[msg_len]='\0';
+		if (strcmp(_mode,"enc")==0)
+			printf("Encrypted message: %s\n",out);
+		else
+			printf("Decrypted message: %s\n",out);
+	}
+	free(out);
+	vigenere_key_free(&key);
+}
+
+static int write_all(int fd, const char *buf, size_t n)
+{
+	while (n>0)
+	{
+		ssize_t w=write(fd, buf, n);
+		if (w==-1 && errno==EINTR)
+			continue;
+		if (w<=0)
+			return -1;
+		buf+=w;
+		n-=w;
+	}
+	return 0;
+}
+
+/*
+	A large regular file on stdin is mapped and handled in windows of
+	VIGENERE_WINDOW bytes per thread. Each thread first compacts the letters
+	of its part of the window; once the letter counts are known, the key
+	position of every part is known, and the threads encipher their letters
+	in place.
+*/
+#define VIGENERE_WINDOW (4<<20)
+#define VIGENERE_MT_MIN (16<<20)
+
+struct vigenere_part {
+	const struct vigenere_key *key;
+	const char *in;
+	size_t n;
+	char *out;
+	size_t letters;
+	size_t pos;
+};
+
+static void *vigenere_compact_worker(void *arg)
+{
+	struct vigenere_part *part=arg;
+	part->letters=vigenere_letters(part->in, part->n, part->out);
+	return NULL;
+}
+
+static void *vigenere_apply_worker(void *arg)
+{
+	struct vigenere_part *part=arg;
+	vigenere_apply(part->key, part->pos, part->out, part->out, part->letters);
+	return NULL;
+}
+
+/**
+ * Encipher a mapped input on `threads` threads
+ * @return number of letters written, -1 if writing failed
+ */
+ssize_t vigenere_mt(const struct vigenere_key *key, const char *data, size_t size,
+	int out_fd, int threads)
+{
+	struct vigenere_part *parts=calloc(threads, sizeof(struct vigenere_part));
+	pthread_t *ids=malloc(sizeof(pthread_t)*threads);
+	char *out=malloc((size_t)threads*VIGENERE_WINDOW);
+	size_t pos=0;
+	for (size_t off=0;off<size;)
+	{
+		int used=0;
+		for (;used<threads && off<size;++used)
+		{
+			parts[used].key=key;
+			parts[used].in=data+off;
+			parts[used].n=size-off<VIGENERE_WINDOW?size-off:VIGENERE_WINDOW;
+			parts[used].out=out+(size_t)used*VIGENERE_WINDOW;
+			off+=parts[used].n;
+		}
+		for (int i=0;i<used;++i)
+			pthread_create(&ids[i], NULL, vigenere_compact_worker, &parts[i]);
+		for (int i=0;i<used;++i)
+			pthread_join(ids[i], NULL);
+		for (int i=0;i<used;++i)
+		{
+			parts[i].pos=pos;
+			pos+=parts[i].letters;
+			pthread_create(&ids[i], NULL, vigenere_apply_worker, &parts[i]);
+		}
+		for (int i=0;i<used;++i)
+			pthread_join(ids[i], NULL);
+		for (int i=0;i<used;++i)
+			if (write_all(out_fd, parts[i].out, parts[i].letters)==-1)
+			{
+				pos=-1;
+				off=size;
+				break;
+			}
+	}
+	free(out);
+	free(ids);
+	free(parts);
+	return pos;
+}
+
+/**
+ * vigenere enc|dec KEY: encipher in_fd to out_fd as a filter
+ * The letters come out as one upper case line, like the argument form.
+ * @return SUCCESS
+ */
+int vigenere_stream_func(char *mode, char *_key, int in_fd, int out_fd)
+{
+	struct vigenere_key key;
+	if (vigenere_key_init(&key, mode, _key)==-1)
+		return SUCCESS;
+
+	struct stat st;
+	long cores=sysconf(_SC_NPROCESSORS_ONLN);
+	off_t start=lseek(in_fd, 0, SEEK_CUR);
+	if (cores>1 && start!=-1 && fstat(in_fd, &st)==0 && S_ISREG(st.st_mode)
+		&& st.st_size-start>=VIGENERE_MT_MIN)
+	{
+		char *data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+		if (data!=MAP_FAILED)
+		{
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			if (vigenere_mt(&key, data+start, st.st_size-start, out_fd, cores)!=-1)
+				write_all(out_fd, "\n", 1);
+			lseek(in_fd, st.st_size, SEEK_SET);
+			munmap(data, st.st_size);
+			vigenere_key_free(&key);
+			return SUCCESS;
+		}
+	}
+
+	char *in=malloc(VIGENERE_BLOCK), *out=malloc(VIGENERE_BLOCK+1);
+	size_t pos=0;
+	ssize_t n;
+	while ((n=read(in_fd, in, VIGENERE_BLOCK))!=0)
+	{
+		if (n==-1)
+		{
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+		size_t letters=vigenere_letters(in, n, out);
+		vigenere_apply(&key, pos, out, out, letters);
+		pos+=letters;
+		if (write_all(out_fd, out, letters)==-1)
+			break;
+	}
+	write_all(out_fd, "\n", 1);
+	free(in);
+	free(out);
+	vigenere_key_free(&key);
+	return SUCCESS;
+}
+
+/*
+	vigenere crack recovers the key of a ciphertext. Every candidate key
+	length splits the letters into columns enciphered with a single shift;
+	the right length (and its multiples) gives columns with the index of
+	coincidence of English instead of that of random text. The lengths are
+	scored on a pool of threads, then each column of the shortest length
+	scoring close to the best is solved by chi-squared against English
+	letter frequencies.
+*/
+#define VIGENERE_MAX_KEY 64
+#define VIGENERE_MIN_COLUMN 8 // letters needed per column to trust its statistics
+#define IC_RANDOM (1.0/26)
+#define IC_ENGLISH 0.0667
+
+static const double english_freq[26] = {
+	.08167, .01492, .02782, .04253, .12702, .02228, .02015, .06094, .06966,
+	.00153, .00772, .04025, .02406, .06749, .07507, .01929, .00095, .05987,
+	.06327, .09056, .02758, .00978, .02360, .00150, .01974, .00074
+};
+
+/**
+ * Count the letters of one column, every stride-th value from start
+ * Four banks of counters keep repeated letters from waiting on each other.
+ */
+static size_t column_histogram(const unsigned char *v, size_t n, size_t start,
+	size_t stride, unsigned int hist[26])
+{
+	unsigned int bank[4][26];
+	memset(bank, 0, sizeof(bank));
+	size_t i=start, count=0;
+	for (;i+3*stride<n;i+=4*stride, count+=4)
+	{
+		bank[0][v[i]]++;
+		bank[1][v[i+stride]]++;
+		bank[2][v[i+2*stride]]++;
+		bank[3][v[i+3*stride]]++;
+	}
+	for (;i<n;i+=stride, count++)
+		bank[0][v[i]]++;
+	for (int c=0;c<26;++c)
+		hist[c]=bank[0][c]+bank[1][c]+bank[2][c]+bank[3][c];
+	return count;
+}
+
+struct crack_job {
+	const unsigned char *v;
+	size_t n;
+	int max_len;
+	int next; // next key length to score, taken atomically
+	double ic[VIGENERE_MAX_KEY+1];
+};
+
+static void *crack_worker(void *arg)
+{
+	struct crack_job *job=arg;
+	int len;
+	while ((len=__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))<=job->max_len)
+	{
+		double sum=0;
+		for (int col=0;col<len;++col)
+		{
+			unsigned int hist[26];
+			size_t count=column_histogram(job->v, job->n, col, len, hist);
+			double pairs=0;
+			for (int c=0;c<26;++c)
+				pairs+=(double)hist[c]*(hist[c]-1);
+			sum+=count>1?pairs/((double)count*(count-1)):0;
+		}
+		job->ic[len]=sum/len;
+	}
+	return NULL;
+}
+
+/**
+ * Find the key shift of a column by chi-squared against English
+ * @return shift in 0..25
+ */
+static int crack_column(const unsigned int hist[26], size_t count)
+{
+	int best=0;
+	double best_chi=-1;
+	for (int shift=0;shift<26;++shift)
+	{
+		double chi=0;
+		for (int c=0;c<26;++c)
+		{
+			double expected=english_freq[c]*count;
+			double d=hist[(c+shift)%26]-expected;
+			chi+=d*d/expected;
+		}
+		if (best_chi<0 || chi<best_chi)
+		{
+			best_chi=chi;
+			best=shift;
+		}
+	}
+	return best;
+}
+
+/**
+ * vigenere crack [TEXT]: guess the key of a ciphertext, read from in_fd without TEXT
+ * @param  out where the key and the start of the plaintext go
+ * @return SUCCESS
+ */
+int vigenere_crack_func(char *text, int in_fd, FILE *out)
+{
+	size_t n=0, capacity=VIGENERE_BLOCK;
+	char *letters=malloc(capacity);
+	if (text)
+	{
+		size_t len=strlen(text);
+		letters=realloc(letters, len+1);
+		n=vigenere_letters(text, len, letters);
+	}
+	else
+	{
+		char *in=malloc(VIGENERE_BLOCK);
+		ssize_t r;
+		while ((r=read(in_fd, in, VIGENERE_BLOCK))!=0)
+		{
+			if (r==-1)
+			{
+				if (errno==EINTR)
+					continue;
+				break;
+			}
+			if (n+r>capacity)
+			{
+				while (n+r>capacity)
+					capacity*=2;
+				letters=realloc(letters, capacity);
+			}
+			n+=vigenere_letters(in, r, letters+n);
+		}
+		free(in);
+	}
+
+	unsigned char *v=(unsigned char *)letters;
+	for (size_t i=0;i<n;++i)
+		v[i]=(letters[i]&0xdf)-'A';
+
+	struct crack_job job;
+	memset(&job, 0, sizeof(job));
+	job.v=v;
+	job.n=n;
+	job.next=1;
+	job.max_len=n/VIGENERE_MIN_COLUMN<VIGENERE_MAX_KEY?n/VIGENERE_MIN_COLUMN:VIGENERE_MAX_KEY;
+	if (job.max_len<1)
+	{
+		fprintf(out, "%s\n","not enough letters to crack");
+		free(letters);
+		return SUCCESS;
+	}
+
+	long cores=sysconf(_SC_NPROCESSORS_ONLN);
+	int threads=cores<1?1:cores>job.max_len?job.max_len:cores;
+	pthread_t *ids=malloc(sizeof(pthread_t)*threads);
+	for (int i=1;i<threads;++i)
+		pthread_create(&ids[i], NULL, crack_worker, &job);
+	crack_worker(&job);
+	for (int i=1;i<threads;++i)
+		pthread_join(ids[i], NULL);
+	free(ids);
+
+	//multiples of the key length score as well, take the shortest one that
+	//looks like English or comes near the best score
+	double best=0;
+	for (int len=1;len<=job.max_len;++len)
+		if (job.ic[len]>best)
+			best=job.ic[len];
+	double threshold=best-0.1*(best-IC_RANDOM);
+	if (threshold>IC_RANDOM+0.75*(IC_ENGLISH-IC_RANDOM))
+		threshold=IC_RANDOM+0.75*(IC_ENGLISH-IC_RANDOM);
+	int key_len=1;
+	while (key_len<job.max_len && job.ic[key_len]<threshold)
+		key_len++;
+
+	char *key=malloc(key_len+1);
+	for (int col=0;col<key_len;++col)
+	{
+		unsigned int hist[26];
+		size_t count=column_histogram(v, n, col, key_len, hist);
+		key[col]='A'+crack_column(hist, count);
+	}
+	key[key_len]=0;
+
+	fprintf(out, "Key length: %d (index of coincidence %.4f)\n", key_len, job.ic[key_len]);
+	fprintf(out, "Key: %s\n", key);
+	fprintf(out, "Plaintext: ");
+	for (size_t i=0;i<n && i<80;++i)
+		putc('A'+(v[i]+26-(key[i%key_len]-'A'))%26, out);
+	fprintf(out, "%s\n", n>80?"...":"");
+	fflush(out);
+
+	free(key);
+	free(letters);
+	return SUCCESS;
+}
+
+/**
+ * wiseman N: the wise man speaks a fortune every N minutes, through the scheduler
+ * @param  min minutes between fortunes
+ * @return     SUCCESS
+ */
+int wiseman_function(int min){
+	if (min<=0)
+	{
+		printf("-%s: wiseman: %d: minutes must be positive\n", sysname, min);
+		return SUCCESS;
+	}
+	int64_t period=min*60000000000LL;
+	int id=sched_add("fortune | espeak", period, period);
+	if (id>0 && interactive)
+		printf("[sched %d] every %dm fortune | espeak\n", id, min);
+	return SUCCESS;
 }
 
 int reflex_func(){